@@ -0,0 +1,172 @@
+#include "batch_scheduler.hpp"
+#include "network.hpp"
+#include "ui.hpp"
+#include <algorithm>
+
+namespace fastget {
+
+static constexpr size_t kBytesPerConnection = 4 * 1024 * 1024; // one more connection per this much of a file
+static constexpr size_t kProbeThreads = 8;
+static constexpr size_t kProbeAhead = 64; // jobs probed past the lowest one not yet started
+static constexpr auto kProgressInterval = std::chrono::milliseconds(200);
+
+BatchScheduler::BatchScheduler(const std::vector<BatchJob>& jobs, const std::vector<std::string>& mirrors, const DownloadOptions& options, int max_per_host)
+    : jobs_(jobs.size()), mirrors_(mirrors), options_(options), budget_(std::max(1, options.max_connections)) {
+    host_cap_ = max_per_host > 0 ? std::min(max_per_host, budget_) : budget_;
+    options_.quiet = true;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs_[i].spec = jobs[i];
+        jobs_[i].host = NetworkLayer::GetHost(jobs[i].url);
+    }
+}
+
+BatchScheduler::~BatchScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    probe_wanted_.notify_all();
+    for (auto& prober : probers_) {
+        if (prober.joinable()) prober.join();
+    }
+    for (auto& job : jobs_) {
+        if (job.thread.joinable()) job.thread.join();
+    }
+}
+
+bool BatchScheduler::Run() {
+    auto start_time = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < std::min(kProbeThreads, jobs_.size()); ++i) {
+        probers_.emplace_back(&BatchScheduler::ProbeLoop, this);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (finished_ < jobs_.size()) {
+        LaunchReady();
+        changed_.wait_for(lock, kProgressInterval);
+        for (size_t index : done_) Report(jobs_[index]);
+        done_.clear();
+
+        size_t bytes = finished_bytes_;
+        for (size_t index : running_) bytes += jobs_[index].downloader->GetDownloadedSize();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        double speed = elapsed.count() > 0 ? bytes / elapsed.count() : 0.0;
+        UI::UpdateBatchProgress(finished_, jobs_.size(), running_.size(), bytes, speed);
+    }
+    stopping_ = true;
+    lock.unlock();
+    probe_wanted_.notify_all();
+    for (auto& prober : probers_) prober.join();
+    probers_.clear();
+
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start_time;
+    double avg_speed = diff.count() > 0 ? finished_bytes_ / diff.count() : 0.0;
+    UI::PrintBatchSummary(jobs_.size(), failed_, finished_bytes_, avg_speed, static_cast<long>(diff.count()), peak_in_use_);
+    return failed_ == 0;
+}
+
+void BatchScheduler::Pause() {
+    // Called from the signal handler; never wait for the lock there.
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) return;
+    for (size_t index : running_) jobs_[index].downloader->Pause();
+}
+
+void BatchScheduler::ProbeLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        probe_wanted_.wait(lock, [this] {
+            return stopping_ || (next_probe_ < jobs_.size() && next_probe_ < first_waiting_ + kProbeAhead);
+        });
+        if (stopping_) return;
+
+        Job& job = jobs_[next_probe_++];
+        job.state = State::Probing;
+        lock.unlock();
+        auto downloader = std::make_unique<Downloader>(job.spec.url, mirrors_, job.spec.output_path, options_);
+        downloader->Probe();
+        lock.lock();
+
+        job.size = downloader->GetTotalSize();
+        job.downloader = std::move(downloader);
+        job.state = State::Ready;
+        changed_.notify_all();
+    }
+}
+
+void BatchScheduler::LaunchReady() {
+    std::set<std::string> blocked_hosts;
+    for (size_t i = first_waiting_; i < jobs_.size() && i < first_waiting_ + kProbeAhead; ++i) {
+        Job& job = jobs_[i];
+        if (job.state != State::Ready) continue;
+
+        // A file starts once it can have at least half the connections it
+        // wants. Short of that on its host, files for other hosts may pass
+        // it; short of that globally, nothing behind it may.
+        int wanted = WantedConnections(job.size);
+        int needed = (wanted + 1) / 2;
+        int host_free = host_cap_ - host_in_use_[job.host];
+        if (blocked_hosts.count(job.host) || host_free < needed) {
+            blocked_hosts.insert(job.host);
+            continue;
+        }
+        int global_free = budget_ - in_use_;
+        if (global_free < needed) break;
+        Launch(i, std::min({wanted, host_free, global_free}));
+    }
+
+    size_t before = first_waiting_;
+    while (first_waiting_ < jobs_.size() && (jobs_[first_waiting_].state == State::Running || jobs_[first_waiting_].state == State::Done)) {
+        first_waiting_++;
+    }
+    if (first_waiting_ != before) probe_wanted_.notify_all();
+}
+
+void BatchScheduler::Launch(size_t index, int connections) {
+    Job& job = jobs_[index];
+    job.state = State::Running;
+    job.connections = connections;
+    in_use_ += connections;
+    host_in_use_[job.host] += connections;
+    peak_in_use_ = std::max(peak_in_use_, in_use_);
+    running_.insert(index);
+
+    job.downloader->LimitConnections(connections);
+    job.thread = std::thread([this, index] {
+        bool success = jobs_[index].downloader->Start();
+        std::lock_guard<std::mutex> lock(mutex_);
+        Finish(index, success);
+    });
+}
+
+void BatchScheduler::Finish(size_t index, bool success) {
+    Job& job = jobs_[index];
+    if (job.state == State::Running) {
+        in_use_ -= job.connections;
+        host_in_use_[job.host] -= job.connections;
+        running_.erase(index);
+    }
+    job.state = State::Done;
+    job.success = success;
+    finished_++;
+    if (!success) failed_++;
+    done_.push_back(index);
+    changed_.notify_all();
+}
+
+void BatchScheduler::Report(Job& job) {
+    if (job.thread.joinable()) job.thread.join();
+    finished_bytes_ += job.downloader->GetDownloadedSize();
+    // A streamed file only knows its size once it is done.
+    UI::PrintBatchResult(job.spec.output_path, job.downloader->GetTotalSize(), job.success, job.downloader->GetError());
+    // Thousands of files may go through; keep only what is running.
+    job.downloader.reset();
+}
+
+int BatchScheduler::WantedConnections(size_t size) const {
+    int per_file = options_.num_threads > 0 ? options_.num_threads : budget_;
+    size_t wanted = (size + kBytesPerConnection - 1) / kBytesPerConnection;
+    return static_cast<int>(std::clamp<size_t>(wanted, 1, static_cast<size_t>(std::min({per_file, host_cap_, budget_}))));
+}
+
+}
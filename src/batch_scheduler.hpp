@@ -0,0 +1,90 @@
+#pragma once
+#include "downloader.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fastget {
+
+struct BatchJob {
+    std::string url;
+    std::string output_path;
+};
+
+// Runs a list of downloads side by side under one connection budget,
+// options.max_connections across all files, and an optional cap per host.
+// Each file is granted connections in proportion to its size when it
+// starts, one for a small file and up to the whole budget for a large one,
+// and gives them back when it finishes. Files start in list order; one that
+// has to wait for the global budget holds back the files behind it so a
+// large file is not starved by a stream of small ones, while one waiting on
+// its host's cap lets files for other hosts go ahead. Size probes for
+// upcoming files run on a few threads of their own, so the HEAD round trips
+// overlap with transfers already under way.
+class BatchScheduler {
+public:
+    // `max_per_host` caps connections to any one host; 0 means no cap beyond
+    // the global budget.
+    BatchScheduler(const std::vector<BatchJob>& jobs, const std::vector<std::string>& mirrors, const DownloadOptions& options, int max_per_host);
+    ~BatchScheduler();
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // Returns once every file has finished; true if all of them succeeded.
+    bool Run();
+    // Pauses every running download and saves its resume state.
+    void Pause();
+
+private:
+    enum class State { Queued, Probing, Ready, Running, Done };
+
+    struct Job {
+        BatchJob spec;
+        std::string host;
+        State state = State::Queued;
+        std::unique_ptr<Downloader> downloader;
+        std::thread thread;
+        int connections = 0;
+        bool success = false;
+        size_t size = 0;
+    };
+
+    void ProbeLoop();
+    void LaunchReady();
+    void Launch(size_t index, int connections);
+    void Finish(size_t index, bool success);
+    void Report(Job& job);
+    int WantedConnections(size_t size) const;
+
+    std::vector<Job> jobs_;
+    std::vector<std::string> mirrors_;
+    DownloadOptions options_;
+    int budget_;
+    int host_cap_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;       // a probe or a download finished
+    std::condition_variable probe_wanted_;  // the probe window moved
+    std::vector<std::thread> probers_;
+    bool stopping_ = false;
+
+    size_t next_probe_ = 0;
+    size_t first_waiting_ = 0; // lowest job not yet started
+    size_t finished_ = 0;
+    size_t failed_ = 0;
+    std::set<size_t> running_;
+    std::vector<size_t> done_;  // finished jobs not yet reported
+    int in_use_ = 0;
+    int peak_in_use_ = 0;
+    std::map<std::string, int> host_in_use_;
+    size_t finished_bytes_ = 0;
+};
+
+}
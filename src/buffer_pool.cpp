@@ -0,0 +1,167 @@
+#include "buffer_pool.hpp"
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace fastget {
+
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other) {
+        Release();
+        pool_ = other.pool_;
+        data_ = other.data_;
+        capacity_ = other.capacity_;
+        other.pool_ = nullptr;
+        other.data_ = nullptr;
+        other.capacity_ = 0;
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::Release() {
+    if (pool_ && data_) pool_->Return(data_, capacity_);
+    pool_ = nullptr;
+    data_ = nullptr;
+    capacity_ = 0;
+}
+
+BufferPool::BufferPool(bool huge_pages) : huge_pages_(huge_pages) {}
+
+BufferPool::~BufferPool() {
+    Trim();
+}
+
+int BufferPool::ClassIndex(size_t size) {
+    if (size > kMaxClassSize) return -1;
+    int index = 0;
+    size_t class_size = kMinClassSize;
+    while (class_size < size) {
+        class_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+BufferPool::Buffer BufferPool::Acquire(size_t size) {
+    Buffer buffer;
+    int index = ClassIndex(size);
+    size_t capacity = index < 0 ? size : kMinClassSize << index;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t limit = limit_;
+    if (limit > 0 && in_use_ + capacity > limit) return buffer;
+
+    char* data = nullptr;
+    if (index >= 0) {
+        auto& list = free_[static_cast<size_t>(index)];
+        if (!list.empty()) {
+            data = list.back();
+            list.pop_back();
+        }
+    }
+    if (!data) {
+        if (limit > 0 && reserved_ + capacity > limit) TrimLocked(reserved_ + capacity - limit);
+        data = Allocate(capacity);
+        if (!data) return buffer;
+        reserved_ += capacity;
+    }
+
+    in_use_ += capacity;
+    if (in_use_ > high_water_) high_water_ = in_use_.load();
+
+    buffer.pool_ = this;
+    buffer.data_ = data;
+    buffer.capacity_ = capacity;
+    return buffer;
+}
+
+void BufferPool::Return(char* data, size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_use_ -= capacity;
+    int index = ClassIndex(capacity);
+    if (index < 0) {
+        Deallocate(data, capacity);
+        reserved_ -= capacity;
+        return;
+    }
+    free_[static_cast<size_t>(index)].push_back(data);
+}
+
+void BufferPool::Charge(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t limit = limit_;
+    if (limit > 0 && reserved_ + bytes > limit) TrimLocked(reserved_ + bytes - limit);
+    reserved_ += bytes;
+    in_use_ += bytes;
+    if (in_use_ > high_water_) high_water_ = in_use_.load();
+}
+
+void BufferPool::Discharge(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reserved_ -= bytes;
+    in_use_ -= bytes;
+}
+
+void BufferPool::Trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TrimLocked(reserved_);
+}
+
+void BufferPool::TrimLocked(size_t wanted) {
+    // Cached buffers of other size classes are the first thing to give back
+    // when the limit needs room for a new allocation.
+    size_t released = 0;
+    for (size_t i = kClassCount; i-- > 0 && released < wanted;) {
+        size_t capacity = kMinClassSize << i;
+        auto& list = free_[i];
+        while (!list.empty() && released < wanted) {
+            Deallocate(list.back(), capacity);
+            list.pop_back();
+            reserved_ -= capacity;
+            released += capacity;
+        }
+    }
+}
+
+#ifdef _WIN32
+
+char* BufferPool::Allocate(size_t capacity) {
+    return static_cast<char*>(std::malloc(capacity));
+}
+
+void BufferPool::Deallocate(char* data, size_t) {
+    std::free(data);
+}
+
+#else
+
+char* BufferPool::Allocate(size_t capacity) {
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit huge pages only exist if the admin reserved some; otherwise
+    // fall back to transparent huge pages below.
+    if (huge_pages_ && capacity % kHugePageSize == 0) {
+        memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+        if (huge_pages_ && capacity >= kHugePageSize) madvise(memory, capacity, MADV_HUGEPAGE);
+#endif
+    }
+    return static_cast<char*>(memory);
+}
+
+void BufferPool::Deallocate(char* data, size_t capacity) {
+    munmap(data, capacity);
+}
+
+#endif
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace fastget {
+
+// Size-class arena for transfer buffers. Connections borrow a buffer per
+// transfer and hand it back when done, so steady-state downloads reuse
+// already-faulted memory instead of going through the allocator. An optional
+// limit caps the memory held across every download sharing the pool.
+class BufferPool {
+public:
+    static constexpr size_t kMinClassSize = 64 * 1024;
+    static constexpr size_t kMaxClassSize = 16 * 1024 * 1024;
+    static constexpr size_t kClassCount = 9; // 64 KiB .. 16 MiB
+
+    class Buffer {
+    public:
+        Buffer() = default;
+        ~Buffer() { Release(); }
+        Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+        Buffer& operator=(Buffer&& other) noexcept;
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        char* data() const { return data_; }
+        size_t capacity() const { return capacity_; }
+        explicit operator bool() const { return data_ != nullptr; }
+        void Release();
+
+    private:
+        friend class BufferPool;
+        BufferPool* pool_ = nullptr;
+        char* data_ = nullptr;
+        size_t capacity_ = 0;
+    };
+
+    explicit BufferPool(bool huge_pages = false);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns an empty buffer when the allocation fails or would exceed the
+    // limit; callers are expected to back off and try again later.
+    Buffer Acquire(size_t size);
+    void Trim();
+    // Counts memory held elsewhere on behalf of the transfers, e.g. spans
+    // waiting to be written in order, against the limit. It never fails;
+    // Acquire() refuses new buffers until enough is discharged again.
+    void Charge(size_t bytes);
+    void Discharge(size_t bytes);
+
+    void SetLimit(size_t bytes) { limit_ = bytes; }
+    size_t GetLimit() const { return limit_; }
+    size_t GetInUse() const { return in_use_; }
+    size_t GetReserved() const { return reserved_; }
+    size_t GetHighWater() const { return high_water_; }
+
+private:
+    static int ClassIndex(size_t size);
+    char* Allocate(size_t capacity);
+    void Deallocate(char* data, size_t capacity);
+    void Return(char* data, size_t capacity);
+    void TrimLocked(size_t wanted);
+
+    bool huge_pages_;
+    std::array<std::vector<char*>, kClassCount> free_;
+    std::mutex mutex_;
+    std::atomic<size_t> limit_{0};
+    std::atomic<size_t> in_use_{0};
+    std::atomic<size_t> reserved_{0};
+    std::atomic<size_t> high_water_{0};
+};
+
+}
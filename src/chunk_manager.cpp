@@ -3,90 +3,234 @@
 
 namespace fastget {
 
-ChunkManager::ChunkManager(size_t total_size, size_t initial_chunk_size)
-    : total_size_(total_size), current_chunk_size_(initial_chunk_size) {
-    
-    if (total_size_ == 0 || initial_chunk_size == 0) return;
-
-    size_t offset = 0;
-    size_t id = 0;
-    const size_t MAX_CHUNKS = 1000000;
-
-    while (offset < total_size_ && id < MAX_CHUNKS) {
-        size_t end = std::min(offset + current_chunk_size_ - 1, total_size_ - 1);
-        chunks_.push_back({id++, offset, end});
-        offset = end + 1;
+static constexpr size_t kMaxBlocks = 1000000;
+static constexpr size_t kMinChunkSize = 512 * 1024;
+static constexpr size_t kMaxChunkSize = 16 * 1024 * 1024;
+
+ChunkManager::ChunkManager(size_t total_size, size_t block_size)
+    : total_size_(total_size), block_size_(block_size), current_chunk_size_(block_size) {
+
+    if (total_size_ == 0 || block_size_ == 0) return;
+
+    // Keep the resume bitmap bounded by growing the block size for huge files.
+    while ((total_size_ + block_size_ - 1) / block_size_ > kMaxBlocks) {
+        block_size_ *= 2;
     }
+    current_chunk_size_ = block_size_;
+}
+
+ChunkManager::~ChunkManager() {
+    for (auto& segment : segments_) delete segment.load();
 }
 
 Chunk* ChunkManager::GetNextChunk() {
-    std::lock_guard<std::mutex> lock(manager_mutex_);
-    for (auto& chunk : chunks_) {
-        if (!chunk.downloaded && !chunk.in_progress) {
-            chunk.in_progress = true;
-            return &chunk;
-        }
+    // Ranges that came back are older than anything past the cursor, so they
+    // go out first.
+    if (has_pending_.load(std::memory_order_acquire)) {
+        if (Chunk* chunk = TakePending()) return chunk;
     }
-    return nullptr;
+
+    size_t window = window_.load(std::memory_order_relaxed);
+    if (window > 0 && cursor_.load(std::memory_order_relaxed) >= window_start_.load(std::memory_order_relaxed) + window) {
+        return nullptr;
+    }
+
+    // The cursor only ever moves by whole blocks, so every carve stays on
+    // the block grid without having to look at its neighbours.
+    size_t size = ChunkBytes();
+    size_t start = cursor_.fetch_add(size, std::memory_order_relaxed);
+    if (start >= total_size_) return nullptr;
+    size_t end = std::min(start + size, total_size_) - 1;
+    Chunk* chunk = NewChunk(start, end);
+    if (!chunk) {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        ReturnRange(start, end);
+        has_pending_.store(true, std::memory_order_release);
+    }
+    return chunk;
 }
 
-void ChunkManager::MarkSuccess(size_t chunk_id, double speed) {
-    std::lock_guard<std::mutex> lock(manager_mutex_);
-    if (chunk_id < chunks_.size()) {
-        chunks_[chunk_id].downloaded = true;
-        chunks_[chunk_id].in_progress = false;
-        downloaded_count_++;
-        AdaptChunkSize(true, speed);
+Chunk* ChunkManager::TakePending() {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (pending_.empty()) return nullptr;
+
+    auto it = pending_.begin();
+    size_t start = it->first;
+    size_t gap_end = it->second;
+    size_t end = std::min(start + ChunkBytes() - 1, gap_end);
+
+    if (end == gap_end) {
+        pending_.erase(it);
+    } else {
+        auto node = pending_.extract(it);
+        node.key() = end + 1;
+        pending_.insert(std::move(node));
     }
+    Chunk* chunk = NewChunk(start, end);
+    if (!chunk) ReturnRange(start, end);
+    has_pending_.store(!pending_.empty(), std::memory_order_release);
+    return chunk;
+}
+
+Chunk* ChunkManager::SplitChunk(size_t chunk_id, size_t split_at) {
+    std::atomic<ChunkState>* state = nullptr;
+    Chunk* victim = FindChunk(chunk_id, &state);
+    if (!victim || state->load(std::memory_order_acquire) != ChunkState::Active) return nullptr;
+    if (split_at <= victim->start + victim->persisted || split_at > victim->end) return nullptr;
+
+    Chunk* chunk = NewChunk(split_at, victim->end);
+    if (chunk) victim->end = split_at - 1;
+    return chunk;
+}
+
+void ChunkManager::MarkSuccess(size_t chunk_id, double speed) {
+    std::atomic<ChunkState>* state = nullptr;
+    Chunk* chunk = FindChunk(chunk_id, &state);
+    ChunkState expected = ChunkState::Active;
+    if (!chunk || !state->compare_exchange_strong(expected, ChunkState::Done)) return;
+    completed_bytes_ += chunk->end - chunk->start + 1;
+    AdaptChunkSize(true, speed);
 }
 
 void ChunkManager::MarkFailed(size_t chunk_id) {
-    std::lock_guard<std::mutex> lock(manager_mutex_);
-    if (chunk_id < chunks_.size()) {
-        chunks_[chunk_id].in_progress = false;
-        AdaptChunkSize(false, 0);
+    std::atomic<ChunkState>* state = nullptr;
+    Chunk* chunk = FindChunk(chunk_id, &state);
+    ChunkState expected = ChunkState::Active;
+    if (!chunk || !state->compare_exchange_strong(expected, ChunkState::Done)) return;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        ReturnRange(chunk->start, chunk->end);
+        has_pending_.store(true, std::memory_order_release);
+    }
+    AdaptChunkSize(false, 0);
+}
+
+void ChunkManager::MarkRangeCompleted(size_t start, size_t end) {
+    if (start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    // A range reaching past the cursor pulls it forward onto the next block
+    // boundary; whatever the cursor skips that is not part of the range
+    // becomes an ordinary pending range.
+    size_t cursor = cursor_.load(std::memory_order_relaxed);
+    size_t next = std::min(total_size_, (end / block_size_ + 1) * block_size_);
+    while (cursor <= end && !cursor_.compare_exchange_weak(cursor, next, std::memory_order_relaxed)) {
     }
+    if (cursor <= end) {
+        size_t tail_start = std::max(start, cursor);
+        if (cursor < start) ReturnRange(cursor, start - 1);
+        if (end + 1 < next) ReturnRange(end + 1, next - 1);
+        completed_bytes_ += end - tail_start + 1;
+        if (start < tail_start) completed_bytes_ += RemoveRange(start, tail_start - 1);
+    } else {
+        completed_bytes_ += RemoveRange(start, end);
+    }
+    has_pending_.store(!pending_.empty(), std::memory_order_release);
+}
+
+void ChunkManager::ReopenRange(size_t start, size_t end) {
+    if (start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    ReturnRange(start, end);
+    completed_bytes_ -= end - start + 1;
+    has_pending_.store(true, std::memory_order_release);
+}
+
+size_t ChunkManager::GetBlockCount() const {
+    if (block_size_ == 0) return 0;
+    return (total_size_ + block_size_ - 1) / block_size_;
+}
+
+Chunk* ChunkManager::NewChunk(size_t start, size_t end) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    size_t index = id / kSegmentSize;
+    if (index >= kMaxSegments) return nullptr;
+
+    Segment* segment = segments_[index].load(std::memory_order_acquire);
+    if (!segment) {
+        // Whoever loses the race to publish the segment throws theirs away.
+        auto fresh = std::make_unique<Segment>();
+        if (segments_[index].compare_exchange_strong(segment, fresh.get(), std::memory_order_acq_rel)) {
+            segment = fresh.release();
+        }
+    }
+
+    size_t slot = id % kSegmentSize;
+    segment->chunks[slot] = Chunk{id, start, end};
+    segment->states[slot].store(ChunkState::Active, std::memory_order_release);
+    return &segment->chunks[slot];
+}
+
+Chunk* ChunkManager::FindChunk(size_t chunk_id, std::atomic<ChunkState>** state) const {
+    size_t index = chunk_id / kSegmentSize;
+    if (index >= kMaxSegments) return nullptr;
+    Segment* segment = segments_[index].load(std::memory_order_acquire);
+    if (!segment) return nullptr;
+    *state = &segment->states[chunk_id % kSegmentSize];
+    return &segment->chunks[chunk_id % kSegmentSize];
 }
 
-bool ChunkManager::MarkCompleted(size_t chunk_id) {
-    std::lock_guard<std::mutex> lock(manager_mutex_);
-    if (chunk_id >= chunks_.size()) return false;
-    if (!chunks_[chunk_id].downloaded) {
-        chunks_[chunk_id].downloaded = true;
-        chunks_[chunk_id].in_progress = false;
-        downloaded_count_++;
+size_t ChunkManager::ChunkBytes() const {
+    size_t size = current_chunk_size_.load(std::memory_order_relaxed);
+    return std::max(block_size_, size - size % block_size_);
+}
+
+void ChunkManager::ReturnRange(size_t start, size_t end) {
+    auto next = pending_.lower_bound(start);
+    if (next != pending_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->second + 1 == start) {
+            start = prev->first;
+            pending_.erase(prev);
+        }
     }
-    return true;
+    if (next != pending_.end() && next->first == end + 1) {
+        end = next->second;
+        pending_.erase(next);
+    }
+    pending_[start] = end;
 }
 
-bool ChunkManager::GetChunkRange(size_t chunk_id, size_t& start, size_t& end) const {
-    if (chunk_id >= chunks_.size()) return false;
-    start = chunks_[chunk_id].start;
-    end = chunks_[chunk_id].end;
-    return true;
+size_t ChunkManager::RemoveRange(size_t start, size_t end) {
+    size_t removed = 0;
+    auto it = pending_.upper_bound(start);
+    if (it != pending_.begin()) --it;
+
+    while (it != pending_.end() && it->first <= end) {
+        size_t range_start = it->first;
+        size_t range_end = it->second;
+        if (range_end < start) {
+            ++it;
+            continue;
+        }
+
+        it = pending_.erase(it);
+        size_t overlap_start = std::max(range_start, start);
+        size_t overlap_end = std::min(range_end, end);
+        removed += overlap_end - overlap_start + 1;
+        if (range_start < overlap_start) pending_[range_start] = overlap_start - 1;
+        if (range_end > overlap_end) it = pending_.emplace(overlap_end + 1, range_end).first;
+    }
+    return removed;
 }
 
 void ChunkManager::AdaptChunkSize(bool success, double speed) {
+    (void)speed;
+    // Streaks are counted loosely across threads; an occasional lost update
+    // only delays the next size change.
     if (success) {
-        fail_streak_ = 0;
-        success_streak_++;
-        if (success_streak_ >= STREAK_THRESHOLD) {
-            current_chunk_size_ *= 2;
-            success_streak_ = 0;
-            if (current_chunk_size_ > 16 * 1024 * 1024) {
-                current_chunk_size_ = 16 * 1024 * 1024;
-            }
+        if (success_streak_.fetch_add(1, std::memory_order_relaxed) + 1 >= STREAK_THRESHOLD) {
+            success_streak_.store(0, std::memory_order_relaxed);
+            size_t size = current_chunk_size_.load(std::memory_order_relaxed);
+            current_chunk_size_.store(std::min(size * 2, kMaxChunkSize), std::memory_order_relaxed);
         }
     } else {
-        success_streak_ = 0;
-        fail_streak_++;
-        if (fail_streak_ >= 1) {
-            current_chunk_size_ /= 2;
-            if (current_chunk_size_ < 512 * 1024) {
-                current_chunk_size_ = 512 * 1024;
-            }
-            fail_streak_ = 0;
-        }
+        success_streak_.store(0, std::memory_order_relaxed);
+        size_t size = current_chunk_size_.load(std::memory_order_relaxed);
+        current_chunk_size_.store(std::max(size / 2, kMinChunkSize), std::memory_order_relaxed);
     }
 }
 
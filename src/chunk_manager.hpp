@@ -2,6 +2,10 @@
 #include <vector>
 #include <cstdint>
 #include <mutex>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <array>
 
 namespace fastget {
 
@@ -9,37 +13,85 @@ struct Chunk {
     size_t id;
     size_t start;
     size_t end;
-    bool downloaded = false;
-    bool in_progress = false;
+    size_t persisted = 0; // bytes from start already written to the output
+    size_t checkpointed = 0; // bytes from start already recorded in resume state
 };
 
+// Carves ranges on demand from the parts of the file nobody has claimed yet,
+// each sized by the current adaptive estimate. Ranges are aligned to a fixed
+// block grid so resume state can record completion as a compact bitmap.
+//
+// The untouched tail of the file is handed out through an atomic cursor and
+// chunks live in an id-indexed slab, so dispatch and completion take no lock.
+// Only ranges that come back out of order (failures, resume holes) go through
+// a mutex-protected interval map, which dispatch checks first.
 class ChunkManager {
 public:
-    ChunkManager(size_t total_size, size_t initial_chunk_size = 1024 * 1024);
+    ChunkManager(size_t total_size, size_t block_size = 1024 * 1024);
+    ~ChunkManager();
+
+    ChunkManager(const ChunkManager&) = delete;
+    ChunkManager& operator=(const ChunkManager&) = delete;
 
     Chunk* GetNextChunk();
+    // Truncates an in-flight chunk to end just before `split_at` and returns
+    // a new chunk covering the rest, or nullptr if the split is not possible.
+    // Must be called from the thread that completes the victim chunk.
+    Chunk* SplitChunk(size_t chunk_id, size_t split_at);
     void MarkSuccess(size_t chunk_id, double speed);
     void MarkFailed(size_t chunk_id);
-    bool MarkCompleted(size_t chunk_id);
-    bool GetChunkRange(size_t chunk_id, size_t& start, size_t& end) const;
+    void MarkRangeCompleted(size_t start, size_t end);
+    // Hands a range that was counted as completed out again, e.g. after its
+    // data failed verification.
+    void ReopenRange(size_t start, size_t end);
+    // Holds new ranges back once the cursor is `size` bytes past the window
+    // start, so an in-order consumer never has much more than that waiting
+    // ahead of the byte it needs next. 0 turns the window off.
+    void SetWindow(size_t size) { window_ = size; }
+    void AdvanceWindow(size_t start) { window_start_ = start; }
+    size_t GetWindowStart() const { return window_start_; }
 
-    size_t GetTotalChunks() const { return chunks_.size(); }
-    size_t GetDownloadedChunks() const { return downloaded_count_; }
+    size_t GetBlockSize() const { return block_size_; }
+    size_t GetBlockCount() const;
     size_t GetChunkSize() const { return current_chunk_size_; }
-    
-    bool IsFinished() const { return downloaded_count_ == chunks_.size(); }
+    size_t GetCompletedBytes() const { return completed_bytes_; }
+
+    bool IsFinished() const { return completed_bytes_ == total_size_; }
 
 private:
+    static constexpr size_t kSegmentSize = 4096;
+    static constexpr size_t kMaxSegments = 16384; // 64M chunk ids
+
+    enum class ChunkState : uint8_t { Active, Done };
+
+    struct Segment {
+        Chunk chunks[kSegmentSize];
+        std::atomic<ChunkState> states[kSegmentSize];
+    };
+
+    Chunk* NewChunk(size_t start, size_t end);
+    Chunk* FindChunk(size_t chunk_id, std::atomic<ChunkState>** state) const;
+    Chunk* TakePending();
+    size_t ChunkBytes() const;
     void AdaptChunkSize(bool success, double speed);
+    void ReturnRange(size_t start, size_t end);
+    size_t RemoveRange(size_t start, size_t end);
 
     size_t total_size_;
-    size_t current_chunk_size_;
-    std::vector<Chunk> chunks_;
-    size_t downloaded_count_ = 0;
-    std::mutex manager_mutex_;
+    size_t block_size_;
+    std::atomic<size_t> current_chunk_size_;
+    std::atomic<size_t> cursor_{0}; // everything from here to the end is unclaimed
+    std::atomic<size_t> next_id_{0};
+    std::array<std::atomic<Segment*>, kMaxSegments> segments_{};
+    std::atomic<size_t> completed_bytes_{0};
+    std::atomic<size_t> window_{0};
+    std::atomic<size_t> window_start_{0};
+
+    std::map<size_t, size_t> pending_; // unclaimed [start, end] ranges below the cursor
+    std::atomic<bool> has_pending_{false};
+    std::mutex pending_mutex_;
 
-    size_t success_streak_ = 0;
-    size_t fail_streak_ = 0;
+    std::atomic<size_t> success_streak_{0};
     const size_t STREAK_THRESHOLD = 3;
 };
 
@@ -0,0 +1,83 @@
+#include "concurrency_controller.hpp"
+#include <algorithm>
+
+namespace fastget {
+
+static constexpr auto kInterval = std::chrono::milliseconds(500);
+// Share of the throughput the added connections would bring at the current
+// per-connection rate that has to show up for an increase to be kept.
+static constexpr double kMinGainRatio = 0.25;
+static constexpr int kHoldIntervals = 4;
+
+ConcurrencyController::ConcurrencyController(int initial, int ceiling)
+    : limit_(std::clamp(initial, 1, std::max(1, ceiling))), ceiling_(std::max(1, ceiling)) {}
+
+bool ConcurrencyController::Update(std::chrono::steady_clock::time_point now, int active) {
+    if (!interval_open_) {
+        interval_start_ = now;
+        interval_open_ = true;
+    }
+    interval_peak_ = std::max(interval_peak_, active);
+
+    std::chrono::duration<double> elapsed = now - interval_start_;
+    if (elapsed < kInterval) return false;
+
+    double goodput = interval_bytes_ / elapsed.count();
+    int errors = interval_errors_;
+    bool saturated = interval_peak_ >= limit_;
+    interval_start_ = now;
+    interval_bytes_ = 0;
+    interval_errors_ = 0;
+    interval_peak_ = 0;
+
+    int previous = limit_;
+    if (errors > 0) {
+        limit_ = std::max(1, std::min(limit_ - 1, limit_ * 3 / 4));
+        slow_start_ = false;
+        step_ = 1;
+        probe_from_ = 0;
+        hold_ = kHoldIntervals;
+        settling_ = true;
+        return limit_ != previous;
+    }
+
+    if (settling_) {
+        settling_ = false;
+        return false;
+    }
+
+    if (probe_from_ > 0) {
+        double expected = probe_goodput_ / probe_from_ * (limit_ - probe_from_);
+        if (goodput - probe_goodput_ < expected * kMinGainRatio) {
+            // More connections stopped adding throughput: go back and sit
+            // there for a while before trying one more.
+            limit_ = probe_from_;
+            slow_start_ = false;
+            step_ = 1;
+            probe_from_ = 0;
+            hold_ = kHoldIntervals;
+            settling_ = true;
+            return true;
+        }
+        if (!slow_start_) step_ *= 2;
+        probe_from_ = 0;
+    }
+
+    if (hold_ > 0) {
+        hold_--;
+        return false;
+    }
+    if (!saturated || limit_ >= ceiling_) return false;
+
+    StartProbe(goodput);
+    return true;
+}
+
+void ConcurrencyController::StartProbe(double goodput) {
+    probe_from_ = limit_;
+    probe_goodput_ = goodput;
+    limit_ = std::min(ceiling_, slow_start_ ? limit_ * 2 : limit_ + step_);
+    settling_ = true;
+}
+
+}
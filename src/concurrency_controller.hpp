@@ -0,0 +1,44 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+
+namespace fastget {
+
+// Decides how many transfers a download keeps in flight. The limit grows
+// while extra connections still buy throughput (doubling at first, then in
+// steps that restart at one after each setback) and shrinks multiplicatively
+// when servers start failing requests. Driven from the transfer loop, so not thread-safe.
+class ConcurrencyController {
+public:
+    ConcurrencyController(int initial, int ceiling);
+
+    void RecordBytes(size_t bytes) { interval_bytes_ += bytes; }
+    void RecordError() { interval_errors_++; }
+
+    // Samples the number of running transfers and closes the measurement
+    // interval once it is due. Returns true when the limit changed.
+    bool Update(std::chrono::steady_clock::time_point now, int active);
+
+    int GetLimit() const { return limit_; }
+    int GetCeiling() const { return ceiling_; }
+
+private:
+    void StartProbe(double goodput);
+
+    int limit_;
+    int ceiling_;
+    bool slow_start_ = true;
+    int step_ = 1;          // increment once out of slow start
+    bool settling_ = true;  // the interval after a change only warms up new connections
+    int probe_from_ = 0;    // limit before the increase under test, 0 when not probing
+    double probe_goodput_ = 0.0;
+    int hold_ = 0;          // intervals to wait before probing again
+
+    std::chrono::steady_clock::time_point interval_start_;
+    bool interval_open_ = false;
+    size_t interval_bytes_ = 0;
+    int interval_errors_ = 0;
+    int interval_peak_ = 0;
+};
+
+}
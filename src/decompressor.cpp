@@ -0,0 +1,333 @@
+#include "decompressor.hpp"
+#include "pipe_writer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#ifdef FASTGET_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FASTGET_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef FASTGET_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace fastget {
+
+static constexpr size_t kQueueBytes = 32 * 1024 * 1024; // compressed bytes waiting for the decoder
+static constexpr size_t kOutputBlockSize = 256 * 1024;
+static constexpr size_t kMagicBytes = 6;
+static constexpr int kStdoutFd = 1;
+
+static const unsigned char kGzipMagic[] = {0x1f, 0x8b};
+static const unsigned char kXzMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const unsigned char kZstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+using Sink = std::function<bool(const char* data, size_t size)>;
+
+struct StreamDecoder {
+    virtual ~StreamDecoder() = default;
+    virtual bool Feed(const char* data, size_t size, const Sink& write, std::string* error) = 0;
+    // Whether the input ended on a complete stream.
+    virtual bool End(const Sink& write, std::string* error) = 0;
+
+    std::vector<char> buffer = std::vector<char>(kOutputBlockSize);
+};
+
+namespace {
+
+#ifdef FASTGET_HAVE_ZLIB
+// Concatenated members, as written by pigz or `cat a.gz b.gz`, decode as
+// one stream.
+struct GzipDecoder : StreamDecoder {
+    z_stream stream{};
+    bool member_done = false;
+
+    GzipDecoder() { inflateInit2(&stream, 15 + 16); }
+    ~GzipDecoder() override { inflateEnd(&stream); }
+
+    bool Feed(const char* data, size_t size, const Sink& write, std::string* error) override {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream.avail_in = static_cast<uInt>(size);
+        while (true) {
+            if (member_done) {
+                if (stream.avail_in == 0) return true;
+                inflateReset(&stream);
+                member_done = false;
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+            stream.avail_out = static_cast<uInt>(buffer.size());
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                *error = std::string("Corrupt gzip data") + (stream.msg ? ": " + std::string(stream.msg) : "") + ".";
+                return false;
+            }
+            size_t produced = buffer.size() - stream.avail_out;
+            if (produced > 0 && !write(buffer.data(), produced)) return false;
+            if (result == Z_STREAM_END) {
+                member_done = true;
+            } else if (result == Z_BUF_ERROR || (stream.avail_in == 0 && stream.avail_out > 0)) {
+                return true;
+            }
+        }
+    }
+
+    bool End(const Sink&, std::string* error) override {
+        if (!member_done) *error = "The gzip data ends early.";
+        return member_done;
+    }
+};
+#endif
+
+#ifdef FASTGET_HAVE_LZMA
+struct XzDecoder : StreamDecoder {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    bool ready = false;
+
+    XzDecoder() { ready = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK; }
+    ~XzDecoder() override { lzma_end(&stream); }
+
+    bool Run(lzma_action action, const Sink& write, std::string* error, lzma_ret* last) {
+        do {
+            stream.next_out = reinterpret_cast<uint8_t*>(buffer.data());
+            stream.avail_out = buffer.size();
+            *last = lzma_code(&stream, action);
+            if (*last == LZMA_BUF_ERROR && action == LZMA_FINISH) {
+                *error = "The xz data ends early.";
+                return false;
+            }
+            if (*last != LZMA_OK && *last != LZMA_STREAM_END) {
+                *error = *last == LZMA_MEMLIMIT_ERROR || *last == LZMA_MEM_ERROR ? "Out of memory decoding xz data." : "Corrupt xz data.";
+                return false;
+            }
+            size_t produced = buffer.size() - stream.avail_out;
+            if (produced > 0 && !write(buffer.data(), produced)) return false;
+        } while (*last == LZMA_OK && (stream.avail_in > 0 || stream.avail_out == 0 || action == LZMA_FINISH));
+        return true;
+    }
+
+    bool Feed(const char* data, size_t size, const Sink& write, std::string* error) override {
+        if (!ready) {
+            *error = "Could not set up the xz decoder.";
+            return false;
+        }
+        stream.next_in = reinterpret_cast<const uint8_t*>(data);
+        stream.avail_in = size;
+        lzma_ret last;
+        return Run(LZMA_RUN, write, error, &last);
+    }
+
+    bool End(const Sink& write, std::string* error) override {
+        stream.next_in = nullptr;
+        stream.avail_in = 0;
+        lzma_ret last;
+        if (!Run(LZMA_FINISH, write, error, &last)) return false;
+        if (last != LZMA_STREAM_END) *error = "The xz data ends early.";
+        return last == LZMA_STREAM_END;
+    }
+};
+#endif
+
+#ifdef FASTGET_HAVE_ZSTD
+struct ZstdDecoder : StreamDecoder {
+    ZSTD_DStream* stream = ZSTD_createDStream();
+    size_t hint = 1; // 0 once the last frame is fully decoded and flushed
+
+    ZstdDecoder() { ZSTD_initDStream(stream); }
+    ~ZstdDecoder() override { ZSTD_freeDStream(stream); }
+
+    bool Feed(const char* data, size_t size, const Sink& write, std::string* error) override {
+        ZSTD_inBuffer in{data, size, 0};
+        bool full = false;
+        while (in.pos < in.size || full) {
+            ZSTD_outBuffer out{buffer.data(), buffer.size(), 0};
+            hint = ZSTD_decompressStream(stream, &out, &in);
+            if (ZSTD_isError(hint)) {
+                *error = std::string("Corrupt zstd data: ") + ZSTD_getErrorName(hint) + ".";
+                return false;
+            }
+            if (out.pos > 0 && !write(buffer.data(), out.pos)) return false;
+            full = out.pos == out.size;
+        }
+        return true;
+    }
+
+    bool End(const Sink&, std::string* error) override {
+        if (hint != 0) *error = "The zstd data ends early.";
+        return hint == 0;
+    }
+};
+#endif
+
+bool StartsWith(const std::vector<char>& data, const unsigned char* magic, size_t size) {
+    return data.size() >= size && std::memcmp(data.data(), magic, size) == 0;
+}
+
+}
+
+Decompressor::Decompressor(const std::string& output_path, BufferPool* buffers)
+    : queue_limit_(kQueueBytes), buffers_(buffers) {
+    // Held spans and transfer buffers need the rest of the budget.
+    if (buffers_ && buffers_->GetLimit() > 0) queue_limit_ = std::min(queue_limit_, buffers_->GetLimit() / 4);
+    if (output_path == "-") {
+        output_ = std::make_unique<PipeWriter>(kStdoutFd);
+    } else {
+        output_ = std::make_unique<FileWriter>(output_path);
+    }
+}
+
+Decompressor::~Decompressor() {
+    Finish();
+}
+
+std::string Decompressor::GetError() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+std::string Decompressor::GetSupportedFormats() {
+    std::string formats;
+#ifdef FASTGET_HAVE_ZLIB
+    formats += "gzip";
+#endif
+#ifdef FASTGET_HAVE_LZMA
+    formats += formats.empty() ? "xz" : ", xz";
+#endif
+#ifdef FASTGET_HAVE_ZSTD
+    formats += formats.empty() ? "zstd" : ", zstd";
+#endif
+    return formats;
+}
+
+bool Decompressor::Start() {
+    if (!thread_.joinable()) thread_ = std::thread(&Decompressor::Run, this);
+    return true;
+}
+
+bool Decompressor::OpenOutput() {
+    // Only once the format is known, so a download that is not compressed
+    // leaves an existing file alone. Whatever was there is replaced, not patched.
+    if (opened_) return true;
+    if (!output_->Open() || !output_->Truncate(0)) {
+        reason_ = "Could not open the output for writing.";
+        return false;
+    }
+    opened_ = true;
+    return true;
+}
+
+bool Decompressor::Push(const char* data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return failed_ || queued_bytes_ < queue_limit_; });
+    if (failed_) return false;
+    queue_.emplace_back(data, data + size);
+    queued_bytes_ += size;
+    if (buffers_) buffers_->Charge(size);
+    changed_.notify_all();
+    return true;
+}
+
+bool Decompressor::Finish() {
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+        if (!failed_ && opened_ && !output_->Sync()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failed_ = true;
+            error_ = "Could not write the decompressed output.";
+        }
+        output_->Close();
+    }
+    // A decoder that gave up leaves input behind.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_) buffers_->Discharge(queued_bytes_);
+    queue_.clear();
+    queued_bytes_ = 0;
+    return !failed_;
+}
+
+void Decompressor::Run() {
+    while (true) {
+        std::vector<char> block;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+            if (queue_.empty()) break;
+            block = std::move(queue_.front());
+            queue_.pop_front();
+            queued_bytes_ -= block.size();
+            if (buffers_) buffers_->Discharge(block.size());
+        }
+        changed_.notify_all();
+        if (!Consume(block)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failed_ = true;
+            error_ = reason_;
+            changed_.notify_all();
+            return;
+        }
+    }
+
+    // A stream shorter than the longest magic still has to be identified.
+    bool complete = (decoder_ || SelectDecoder()) && OpenOutput() && decoder_->End([this](const char* data, size_t size) { return Write(data, size); }, &reason_);
+    if (!complete) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+        error_ = reason_;
+    }
+}
+
+bool Decompressor::Consume(const std::vector<char>& block) {
+    Sink write = [this](const char* data, size_t size) { return Write(data, size); };
+    if (decoder_) return decoder_->Feed(block.data(), block.size(), write, &reason_);
+
+    magic_.insert(magic_.end(), block.begin(), block.end());
+    if (magic_.size() < kMagicBytes) return true;
+    if (!SelectDecoder() || !OpenOutput()) return false;
+    std::vector<char> held;
+    held.swap(magic_);
+    return decoder_->Feed(held.data(), held.size(), write, &reason_);
+}
+
+bool Decompressor::SelectDecoder() {
+    std::string format;
+    if (StartsWith(magic_, kGzipMagic, sizeof(kGzipMagic))) {
+        format = "gzip";
+#ifdef FASTGET_HAVE_ZLIB
+        decoder_ = std::make_unique<GzipDecoder>();
+#endif
+    } else if (StartsWith(magic_, kXzMagic, sizeof(kXzMagic))) {
+        format = "xz";
+#ifdef FASTGET_HAVE_LZMA
+        decoder_ = std::make_unique<XzDecoder>();
+#endif
+    } else if (StartsWith(magic_, kZstdMagic, sizeof(kZstdMagic))) {
+        format = "zstd";
+#ifdef FASTGET_HAVE_ZSTD
+        decoder_ = std::make_unique<ZstdDecoder>();
+#endif
+    } else {
+        reason_ = "The download is not gzip, xz or zstd data.";
+        return false;
+    }
+    if (!decoder_) reason_ = format + " support is not built in.";
+    return decoder_ != nullptr;
+}
+
+bool Decompressor::Write(const char* data, size_t size) {
+    if (!output_->WriteAt(output_bytes_, data, size)) {
+        reason_ = "Could not write the decompressed output.";
+        return false;
+    }
+    output_bytes_ += size;
+    return true;
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "buffer_pool.hpp"
+#include "file_writer.hpp"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fastget {
+
+struct StreamDecoder;
+
+// Pipeline stage that decompresses a download while it is still arriving.
+// The compressed bytes are pushed in file order and decoded on a thread of
+// its own, so decoding overlaps the network instead of following it. The
+// format comes from the stream's magic bytes: gzip (zlib), xz (liblzma) and
+// zstd (libzstd), each only if the library was found at build time. The
+// queue between the two sides is bounded; a full queue makes Push() wait,
+// which slows the download down to the decoder's pace.
+class Decompressor {
+public:
+    // `output_path` receives the decompressed data; "-" is stdout. Queued
+    // input is charged to `buffers` and, under a limit, the queue is sized
+    // to a share of it.
+    explicit Decompressor(const std::string& output_path, BufferPool* buffers = nullptr);
+    ~Decompressor();
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Opens the output and starts the decoder thread; a second call is a no-op.
+    bool Start();
+    // False once the decoder has given up, see GetError().
+    bool Push(const char* data, size_t size);
+    // Ends the input and waits for the decoder; true if the stream was
+    // complete and all of it reached the output.
+    bool Finish();
+
+    // Safe to call while the decoder is still running.
+    std::string GetError() const;
+    size_t GetOutputBytes() const { return output_bytes_; }
+    // e.g. "gzip, xz"; empty if built without any of the libraries.
+    static std::string GetSupportedFormats();
+
+private:
+    void Run();
+    bool Consume(const std::vector<char>& block);
+    bool SelectDecoder();
+    bool OpenOutput();
+    bool Write(const char* data, size_t size);
+
+    std::unique_ptr<FileWriter> output_;
+    std::unique_ptr<StreamDecoder> decoder_;
+    std::vector<char> magic_; // leading bytes held until the format is known
+    bool opened_ = false;
+    size_t output_bytes_ = 0;
+    std::string reason_; // decoder thread only; copied to error_ when it gives up
+
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::vector<char>> queue_;
+    size_t queued_bytes_ = 0;
+    size_t queue_limit_;
+    BufferPool* buffers_;
+    bool closed_ = false; // no more input
+    bool failed_ = false; // the decoder stopped; error_ says why
+    std::string error_;
+};
+
+}
@@ -0,0 +1,333 @@
+#include "delta_index.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+namespace fastget {
+
+namespace {
+
+constexpr size_t kSegmentSize = 16 * 1024 * 1024;
+constexpr size_t kNotFound = std::numeric_limits<size_t>::max();
+constexpr size_t kMaxBlockSize = 1024 * 1024;
+
+using Md4Digest = std::array<uint8_t, 16>;
+
+uint32_t Rotl(uint32_t x, int s) { return (x << s) | (x >> (32 - s)); }
+
+void Md4Block(uint32_t state[4], const unsigned char* block) {
+    static const int kOrder2[16] = {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+    static const int kOrder3[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+    static const int kShift1[4] = {3, 7, 11, 19};
+    static const int kShift2[4] = {3, 5, 9, 13};
+    static const int kShift3[4] = {3, 9, 11, 15};
+
+    uint32_t x[16];
+    for (int i = 0; i < 16; ++i) {
+        x[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+    }
+
+    // Each step updates one word and the roles rotate, a <- d <- c <- b.
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 16; ++i) {
+        uint32_t t = Rotl(a + ((b & c) | (~b & d)) + x[i], kShift1[i % 4]);
+        a = d; d = c; c = b; b = t;
+    }
+    for (int i = 0; i < 16; ++i) {
+        uint32_t t = Rotl(a + ((b & c) | (b & d) | (c & d)) + x[kOrder2[i]] + 0x5a827999, kShift2[i % 4]);
+        a = d; d = c; c = b; b = t;
+    }
+    for (int i = 0; i < 16; ++i) {
+        uint32_t t = Rotl(a + (b ^ c ^ d) + x[kOrder3[i]] + 0x6ed9eba1, kShift3[i % 4]);
+        a = d; d = c; c = b; b = t;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+
+// MD4 (RFC 1320), which zsync uses for its strong block checksums. Built in
+// because OpenSSL 3 only offers it through the legacy provider.
+Md4Digest Md4(const unsigned char* data, size_t size) {
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    size_t whole = size - size % 64;
+    for (size_t i = 0; i < whole; i += 64) Md4Block(state, data + i);
+
+    unsigned char tail[128] = {};
+    size_t rest = size - whole;
+    std::memcpy(tail, data + whole, rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for (int i = 0; i < 8; ++i) tail[tail_size - 8 + i] = static_cast<unsigned char>(bits >> (8 * i));
+    for (size_t i = 0; i < tail_size; i += 64) Md4Block(state, tail + i);
+
+    Md4Digest digest;
+    for (int i = 0; i < 16; ++i) digest[i] = static_cast<uint8_t>(state[i / 4] >> (8 * (i % 4)));
+    return digest;
+}
+
+// rsync's rolling checksum over one block: a is the byte sum, b weights
+// each byte by its distance from the end of the block.
+struct Rsum {
+    uint16_t a = 0;
+    uint16_t b = 0;
+
+    void Compute(const unsigned char* data, size_t size) {
+        uint32_t sum_a = 0, sum_b = 0;
+        for (size_t i = 0; i < size; ++i) {
+            sum_a += data[i];
+            sum_b += static_cast<uint32_t>((size - i) * data[i]);
+        }
+        a = static_cast<uint16_t>(sum_a);
+        b = static_cast<uint16_t>(sum_b);
+    }
+
+    // Slides the block one byte forward.
+    void Roll(unsigned char out, unsigned char in, size_t size) {
+        a = static_cast<uint16_t>(a + in - out);
+        b = static_cast<uint16_t>(b + a - static_cast<uint32_t>(size * out));
+    }
+
+    uint32_t Value() const { return (static_cast<uint32_t>(a) << 16) | b; }
+};
+
+std::string Trim(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == std::string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(start, end - start + 1);
+}
+
+bool ParseNumber(const std::string& text, size_t* value) {
+    if (text.empty() || !std::all_of(text.begin(), text.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+        return false;
+    }
+    // The index may come from a server; an out-of-range value is malformed.
+    auto [end, result] = std::from_chars(text.data(), text.data() + text.size(), *value);
+    return result == std::errc() && end == text.data() + text.size();
+}
+
+}
+
+bool DeltaIndex::Load(const std::vector<char>& data, DeltaIndex* index, std::string* error) {
+    *index = DeltaIndex{};
+    std::string text(data.begin(), data.end());
+    if (text.compare(0, 6, "zsync:") != 0) {
+        *error = "not a zsync control file";
+        return false;
+    }
+    size_t header_end = text.find("\n\n");
+    if (header_end == std::string::npos) {
+        *error = "truncated header";
+        return false;
+    }
+
+    bool have_length = false;
+    size_t pos = 0;
+    while (pos < header_end) {
+        size_t eol = text.find('\n', pos);
+        std::string line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        std::string value = Trim(line.substr(colon + 1));
+
+        bool ok = true;
+        if (key == "Filename") {
+            index->filename_ = value;
+        } else if (key == "URL") {
+            if (index->url_.empty()) index->url_ = value;
+        } else if (key == "SHA-1") {
+            index->sha1_ = value;
+            for (char& c : index->sha1_) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        } else if (key == "Blocksize") {
+            ok = ParseNumber(value, &index->block_size_) && index->block_size_ > 0 && index->block_size_ <= kMaxBlockSize;
+        } else if (key == "Length") {
+            ok = have_length = ParseNumber(value, &index->length_);
+        } else if (key == "Hash-Lengths") {
+            size_t seq = 0, rsum = 0, checksum = 0;
+            size_t first = value.find(',');
+            size_t second = first == std::string::npos ? first : value.find(',', first + 1);
+            ok = second != std::string::npos &&
+                 ParseNumber(value.substr(0, first), &seq) &&
+                 ParseNumber(value.substr(first + 1, second - first - 1), &rsum) &&
+                 ParseNumber(value.substr(second + 1), &checksum) &&
+                 seq >= 1 && seq <= 2 && rsum >= 1 && rsum <= 4 && checksum >= 3 && checksum <= 16;
+            index->seq_matches_ = static_cast<int>(seq);
+            index->rsum_bytes_ = static_cast<int>(rsum);
+            index->checksum_bytes_ = static_cast<int>(checksum);
+        } else if (key == "Z-Map2") {
+            // Binary map data follows in the header; we only read plain indexes.
+            *error = "compressed zsync indexes are not supported";
+            return false;
+        }
+        if (!ok) {
+            *error = "bad " + key + " header";
+            return false;
+        }
+    }
+    if (index->block_size_ == 0 || !have_length) {
+        *error = "missing Blocksize or Length header";
+        return false;
+    }
+
+    size_t count = (index->length_ + index->block_size_ - 1) / index->block_size_;
+    size_t entry = static_cast<size_t>(index->rsum_bytes_ + index->checksum_bytes_);
+    size_t body = header_end + 2;
+    if (count >= std::numeric_limits<uint32_t>::max() || text.size() - body != count * entry) {
+        *error = "block checksums do not cover Length";
+        return false;
+    }
+
+    index->rsum_mask_ = index->rsum_bytes_ == 4 ? 0xffffffff : (1u << (8 * index->rsum_bytes_)) - 1;
+    index->rsums_.resize(count);
+    index->checksums_.resize(count * index->checksum_bytes_);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text.data() + body);
+    for (size_t i = 0; i < count; ++i) {
+        // The stored checksum is the tail of the big-endian a, b pair.
+        uint32_t rsum = 0;
+        for (int j = 0; j < index->rsum_bytes_; ++j) rsum = (rsum << 8) | *p++;
+        index->rsums_[i] = rsum;
+        std::memcpy(&index->checksums_[i * index->checksum_bytes_], p, index->checksum_bytes_);
+        p += index->checksum_bytes_;
+    }
+    if (count < 2) index->seq_matches_ = 1;
+    index->BuildTable();
+    return true;
+}
+
+void DeltaIndex::BuildTable() {
+    // A power of two at least twice the number of keys keeps chains short.
+    size_t keys = rsums_.size() - (seq_matches_ - 1);
+    int bits = 1;
+    while ((size_t{1} << bits) < keys * 2 && bits < 31) ++bits;
+    bucket_shift_ = 32 - bits;
+    buckets_.assign(size_t{1} << bits, 0);
+    next_.assign(rsums_.size(), 0);
+
+    // Inserted back to front so chains list blocks in file order.
+    for (size_t i = keys; i-- > 0;) {
+        size_t bucket = Bucket(rsums_[i], seq_matches_ > 1 ? rsums_[i + 1] : 0);
+        next_[i] = buckets_[bucket];
+        buckets_[bucket] = static_cast<uint32_t>(i + 1);
+    }
+}
+
+size_t DeltaIndex::Bucket(uint32_t first, uint32_t second) const {
+    uint32_t key = first * 0x9e3779b1u ^ (second * 0x85ebca77u + 0x165667b1u);
+    return (key * 0x9e3779b1u) >> bucket_shift_;
+}
+
+bool DeltaIndex::Lookup(const unsigned char* data, uint32_t first, uint32_t second, size_t offset, std::vector<size_t>* found) const {
+    Md4Digest digests[2];
+    bool hashed = false;
+    bool matched = false;
+    for (uint32_t entry = buckets_[Bucket(first, second)]; entry != 0; entry = next_[entry - 1]) {
+        size_t block = entry - 1;
+        if (rsums_[block] != first || (seq_matches_ > 1 && rsums_[block + 1] != second)) continue;
+        if ((*found)[block] != kNotFound && (seq_matches_ == 1 || (*found)[block + 1] != kNotFound)) continue;
+
+        if (!hashed) {
+            for (int i = 0; i < seq_matches_; ++i) digests[i] = Md4(data + i * block_size_, block_size_);
+            hashed = true;
+        }
+        bool confirmed = true;
+        for (int i = 0; i < seq_matches_ && confirmed; ++i) {
+            confirmed = std::memcmp(digests[i].data(), &checksums_[(block + i) * checksum_bytes_], checksum_bytes_) == 0;
+        }
+        if (!confirmed) continue;
+
+        for (int i = 0; i < seq_matches_; ++i) {
+            if ((*found)[block + i] == kNotFound) (*found)[block + i] = offset + i * block_size_;
+        }
+        matched = true;
+    }
+    return matched;
+}
+
+bool DeltaIndex::FindBlocks(const std::string& seed_path, std::vector<Copy>* copies) const {
+    copies->clear();
+    std::ifstream seed(seed_path, std::ios::binary);
+    if (!seed.is_open()) return false;
+    if (rsums_.empty()) return true;
+
+    const size_t window = block_size_ * seq_matches_;
+    std::vector<size_t> found(rsums_.size(), kNotFound);
+    std::vector<unsigned char> buffer;
+    size_t buffer_start = 0;
+    bool at_end = false;
+
+    // Segments overlap by a window so no offset is skipped at the seams.
+    auto fill = [&](size_t offset) {
+        buffer.resize(kSegmentSize + window);
+        seed.clear();
+        seed.seekg(static_cast<std::streamoff>(offset));
+        seed.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+        size_t got = static_cast<size_t>(seed.gcount());
+        buffer_start = offset;
+        if (got < buffer.size()) {
+            // A block of zeros past the end lets the short last block of the
+            // target match, as it was checksummed zero-padded.
+            buffer.resize(got);
+            buffer.resize(got + block_size_, 0);
+            at_end = true;
+        }
+    };
+
+    fill(0);
+    size_t pos = 0;
+    bool fresh = true;
+    Rsum sums[2];
+    while (true) {
+        size_t end = buffer_start + buffer.size();
+        if (pos + window > end) {
+            if (at_end) break;
+            fill(pos);
+            fresh = true;
+            continue;
+        }
+
+        const unsigned char* p = buffer.data() + (pos - buffer_start);
+        if (fresh) {
+            for (int i = 0; i < seq_matches_; ++i) sums[i].Compute(p + i * block_size_, block_size_);
+            fresh = false;
+        }
+        uint32_t first = sums[0].Value() & rsum_mask_;
+        uint32_t second = seq_matches_ > 1 ? sums[1].Value() & rsum_mask_ : 0;
+        if (Lookup(p, first, second, pos, &found)) {
+            pos += block_size_;
+            fresh = true;
+            continue;
+        }
+
+        if (pos + window == end) {
+            if (at_end) break;
+            fill(++pos);
+            fresh = true;
+            continue;
+        }
+        for (int i = 0; i < seq_matches_; ++i) sums[i].Roll(p[i * block_size_], p[(i + 1) * block_size_], block_size_);
+        pos++;
+    }
+
+    for (size_t i = 0; i < found.size(); ++i) {
+        if (found[i] == kNotFound) continue;
+        size_t target = i * block_size_;
+        size_t length = std::min(block_size_, length_ - target);
+        if (!copies->empty()) {
+            Copy& last = copies->back();
+            if (last.target + last.length == target && last.source + last.length == found[i]) {
+                last.length += length;
+                continue;
+            }
+        }
+        copies->push_back(Copy{target, found[i], length});
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace fastget {
+
+// A zsync control file: the block checksums of the file being downloaded,
+// used to find blocks that an older local copy (the seed) already has so
+// only the rest needs to come over the network. Each block carries the
+// rsync rolling checksum, which can be slid over the seed one byte at a time,
+// and the leading bytes of its MD4 to confirm a candidate. Like zsync, when
+// the index asks for two matches in a row the rolling checksums of a block
+// and its successor are looked up together, which keeps the short checksums
+// from producing a candidate at almost every seed offset.
+//
+// Compressed (Z-Map2) indexes are not supported.
+class DeltaIndex {
+public:
+    // A run of the target that the seed has at `source`.
+    struct Copy {
+        size_t target;
+        size_t source;
+        size_t length;
+    };
+
+    static bool Load(const std::vector<char>& data, DeltaIndex* index, std::string* error);
+
+    // Scans `seed_path` for blocks of the target. Runs of matched blocks come
+    // back in target order with neighbours merged.
+    bool FindBlocks(const std::string& seed_path, std::vector<Copy>* copies) const;
+
+    const std::string& GetFilename() const { return filename_; }
+    const std::string& GetUrl() const { return url_; }
+    const std::string& GetSha1() const { return sha1_; } // lowercase hex, may be empty
+    size_t GetLength() const { return length_; }
+    size_t GetBlockSize() const { return block_size_; }
+    size_t GetBlockCount() const { return rsums_.size(); }
+
+private:
+    void BuildTable();
+    size_t Bucket(uint32_t first, uint32_t second) const;
+    bool Lookup(const unsigned char* data, uint32_t first, uint32_t second, size_t offset, std::vector<size_t>* found) const;
+
+    std::string filename_;
+    std::string url_;
+    std::string sha1_;
+    size_t length_ = 0;
+    size_t block_size_ = 0;
+    int seq_matches_ = 1;
+    int rsum_bytes_ = 4;
+    int checksum_bytes_ = 16;
+    uint32_t rsum_mask_ = 0xffffffff;
+
+    std::vector<uint32_t> rsums_;       // per block, masked to rsum_bytes_
+    std::vector<uint8_t> checksums_;    // per block, checksum_bytes_ each
+    std::vector<uint32_t> buckets_;     // first block + 1 per bucket, 0 if none
+    std::vector<uint32_t> next_;        // next block + 1 in the same bucket
+    int bucket_shift_ = 0;
+};
+
+}
@@ -2,18 +2,89 @@
 #include <iostream>
 #include <chrono>
 #include <filesystem>
+#include <algorithm>
+#include <fstream>
 
 namespace fastget {
 
+static constexpr int kInitialAdaptiveConnections = 4;
+static constexpr size_t kHashCatchUpBytes = 4 * 1024 * 1024; // per loop iteration
+static constexpr size_t kSeedCopyBufferSize = 1024 * 1024;
+static constexpr size_t kSingleRequestBytes = 1024 * 1024; // a fast-start probe reads files up to this size whole
+static constexpr auto kStreamCheckpointInterval = std::chrono::milliseconds(250);
+static constexpr const char* kStreamMagic = "FASTGET-STREAM";
+static constexpr int kStdoutFd = 1;
+
+// Removes [start, end] from every range in `ranges`.
+static void SubtractRange(std::vector<std::pair<size_t, size_t>>& ranges, size_t start, size_t end) {
+    std::vector<std::pair<size_t, size_t>> kept;
+    for (const auto& [range_start, range_end] : ranges) {
+        if (range_end < start || range_start > end) {
+            kept.emplace_back(range_start, range_end);
+            continue;
+        }
+        if (range_start < start) kept.emplace_back(range_start, start - 1);
+        if (range_end > end) kept.emplace_back(end + 1, range_end);
+    }
+    ranges.swap(kept);
+}
+
 Downloader::Downloader(const std::string& url, const std::vector<std::string>& mirrors, const std::string& output_path, const DownloadOptions& options)
-    : url_(url), mirrors_(mirrors), output_path_(output_path), options_(options), writer_(output_path), resume_state_(ResumePath()) {
+    : url_(url), mirrors_(mirrors), output_path_(output_path), options_(options), resume_state_(ResumePath()) {
+    if (!options_.share) {
+        owned_share_ = std::make_unique<NetworkShare>();
+        options_.share = owned_share_.get();
+    }
+    if (!options_.buffers) {
+        owned_buffers_ = std::make_unique<BufferPool>();
+        options_.buffers = owned_buffers_.get();
+    }
+    if (!options_.limiter && options_.max_rate > 0) {
+        owned_limiter_ = std::make_unique<RateLimiter>(options_.max_rate);
+        options_.limiter = owned_limiter_.get();
+    }
+
+    if (output_path_ == "-" || options_.decompress) {
+        // Nothing to resume into, map or submit to a ring.
+        options_.resume = false;
+        options_.mmap_output = false;
+        options_.io_uring = false;
+        auto pipe = options_.decompress ? std::make_unique<PipeWriter>(std::make_unique<Decompressor>(output_path_, options_.buffers), options_.buffers)
+                                        : std::make_unique<PipeWriter>(kStdoutFd, options_.buffers);
+        pipe_ = pipe.get();
+        writer_ = std::move(pipe);
+    }
+#ifdef FASTGET_HAVE_IO_URING
+    if (!writer_ && options_.io_uring) {
+        writer_ = std::make_unique<UringFileWriter>(output_path_, options_.buffers);
+    }
+#endif
+#ifndef _WIN32
+    if (!writer_ && options_.mmap_output) {
+        writer_ = std::make_unique<MappedFileWriter>(output_path_);
+    }
+#endif
+    if (!writer_) {
+        writer_ = std::make_unique<FileWriter>(output_path_);
+    }
+}
+
+Downloader::~Downloader() {
+    WaitForCheckpoint();
+}
+
+bool Downloader::Probe() {
     std::vector<std::string> all_urls = mirrors_;
     all_urls.insert(all_urls.begin(), url_);
 
     long size = -1;
     NetworkOptions net_options = BuildNetworkOptions();
+    // Resume state means most of the file is here already; the body of a
+    // ranged probe would mostly be thrown away.
+    bool fast = options_.fast_start && !std::filesystem::exists(ResumePath());
     for (const auto& u : all_urls) {
-        size = NetworkLayer::GetFileSize(u, net_options);
+        if (fast) size = NetworkLayer::FetchPrefix(u, net_options, kSingleRequestBytes, &prefix_);
+        if (size <= 0) size = NetworkLayer::GetFileSize(u, net_options);
         if (size > 0) break;
     }
 
@@ -22,143 +93,467 @@ Downloader::Downloader(const std::string& url, const std::vector<std::string>& m
     } else {
         total_size_ = 0;
     }
+    probed_ = true;
+    return total_size_ > 0;
+}
+
+void Downloader::LimitConnections(int connections) {
+    options_.max_connections = std::max(1, connections);
+    if (options_.num_threads > options_.max_connections) options_.num_threads = options_.max_connections;
 }
 
 bool Downloader::Start() {
-    if (total_size_ <= 0) {
+    if (!probed_) Probe();
+    // Without a size there is nothing to split, and a stream left by an
+    // earlier run means the server is known to ignore ranges.
+    if (total_size_ <= 0 || (options_.resume && std::filesystem::exists(StreamStatePath()))) {
+        return Stream();
+    }
+
+    if (options_.expected_size > 0 && total_size_ != options_.expected_size) {
+        error_ = "Server reports " + std::to_string(total_size_) + " bytes, expected " + std::to_string(options_.expected_size) + ".";
+        if (!options_.quiet) std::cerr << error_ << std::endl;
         return false;
     }
 
-    if (!writer_.Open()) {
+    PrepareSeed();
+    size_t existing_size = writer_->Exists() ? writer_->GetSize() : 0;
+    if (!writer_->Open()) {
+        error_ = "Could not open " + output_path_ + " for writing.";
         return false;
     }
 
-    writer_.PreAllocate(total_size_);
+    writer_->PreAllocate(total_size_);
 
     InitializeResumeState();
     if (!chunk_manager_) {
         return false;
     }
 
+    if (!InitializeHasher()) {
+        return false;
+    }
+
     ApplyResumeState();
+    AdoptExistingFile(existing_size);
+    ReuseSeedBlocks();
+    ApplyPrefix();
+    if (pipe_) {
+        // Held spans share the memory limit with the transfer buffers; keep
+        // them to half of it so the range at the head can always get one.
+        size_t window = options_.reorder_window;
+        size_t limit = options_.buffers->GetLimit();
+        if (limit > 0) window = std::min(window, std::max<size_t>(limit / 2, 1));
+        chunk_manager_->SetWindow(window);
+        chunk_manager_->AdvanceWindow(pipe_->GetWritten());
+    }
 
     running_ = true;
     start_time_ = std::chrono::steady_clock::now();
 
-    UI::PrintHeader(output_path_, total_size_, options_.num_threads);
+    bool adaptive = options_.num_threads <= 0;
+    int connections = adaptive ? options_.max_connections : options_.num_threads;
+    if (!options_.quiet) UI::PrintHeader(output_path_, total_size_, connections, adaptive);
 
-    if (chunk_manager_->IsFinished()) {
+    // Resumed or existing data that turns out bad on the whole-file check
+    // sends the download on through the engine after all.
+    bool hashed = chunk_manager_->IsFinished() && (!hasher_ || hasher_->Finish());
+    if (chunk_manager_->IsFinished() && !(hashed && RepairPieces())) {
         running_ = false;
-        UI::PrintFooter(true);
-        UI::PrintSummary(total_size_, downloaded_size_, 0.0, 0, resumed_bytes_ > 0, resumed_bytes_, options_.num_threads);
-        if (options_.resume) {
+        if (!hashed) {
+            error_ = "Could not hash the output file.";
+        } else if (pipe_ && !pipe_->Finish()) {
+            hashed = false;
+            error_ = pipe_->GetError();
+        }
+        if (!options_.quiet) {
+            UI::PrintFooter(hashed, error_);
+            UI::PrintSummary(total_size_, downloaded_size_, 0.0, 0, resumed_bytes_ > 0, resumed_bytes_, 0);
+            if (hashed && pipe_ && pipe_->GetStage()) UI::PrintDecompressed(pipe_->GetStage()->GetOutputBytes());
+            if (hashed && hasher_ && options_.tree_digest) UI::PrintTreeDigest(hasher_->GetTreeDigest());
+        }
+        if (options_.resume && hashed) {
             std::filesystem::remove(ResumePath());
         }
-        return true;
+        if (seed_owned_ && hashed) std::filesystem::remove(seed_path_);
+        return hashed;
     }
 
-    for (int i = 0; i < options_.num_threads; ++i) {
-        threads_.emplace_back(&Downloader::DownloadThread, this);
-    }
-
-    std::thread watcher(&Downloader::ProgressWatcher, this);
+    std::vector<std::string> all_urls = mirrors_;
+    all_urls.insert(all_urls.begin(), url_);
 
-    for (auto& t : threads_) {
-        if (t.joinable()) t.join();
+    EngineOptions engine_options;
+    engine_options.max_connections = connections;
+    if (adaptive) engine_options.initial_connections = std::min(kInitialAdaptiveConnections, connections);
+    engine_options.per_mirror_connections = options_.max_per_mirror;
+    engine_options.retries = options_.retries;
+    engine_options.retry_delay_ms = options_.retry_delay_ms;
+    engine_options.sink = options_.buffered ? SinkMode::Buffered : SinkMode::Streaming;
+    engine_options.buffers = options_.buffers;
+    engine_options.limiter = options_.limiter;
+    engine_options.in_order = pipe_ != nullptr;
+#ifndef _WIN32
+    if (options_.mmap_output) engine_options.sink = SinkMode::Direct;
+#endif
+
+    TransferEngine engine(*chunk_manager_, all_urls, BuildNetworkOptions(), engine_options);
+    engine.SetWriteHandler([this](size_t offset, const char* data, size_t size) {
+        return OnDataReceived(offset, data, size);
+    });
+    engine.SetProgressHandler([this](size_t bytes) {
+        downloaded_size_ += bytes;
+    });
+    engine.SetSuccessHandler([this](Chunk* chunk, double speed) {
+        OnChunkDownloaded(chunk, speed);
+    });
+    engine.SetBackpressureHandler([this]() {
+        return writer_->IsBacklogged();
+    });
+    engine.SetPollHandler([this, &engine]() {
+        writer_->Poll();
+        if (hasher_) hasher_->CatchUp(kHashCatchUpBytes);
+        Checkpoint(engine);
+    });
+
+    std::thread watcher;
+    if (!options_.quiet) watcher = std::thread(&Downloader::ProgressWatcher, this);
+
+    bool finished = false;
+    while (true) {
+        engine.Run(running_, paused_);
+        // With an asynchronous writer the last chunks are only checked here,
+        // and a bad piece among them goes back to the engine.
+        size_t reopened = reopened_pieces_;
+        writer_->Flush();
+        finished = chunk_manager_->IsFinished();
+        if (!finished && running_ && reopened_pieces_ != reopened) continue;
+        if (finished && hasher_ && !hasher_->Finish()) finished = false;
+        if (!finished || !running_ || !RepairPieces()) break;
     }
 
+    bool stream = !finished && running_ && engine.RangesIgnored();
     running_ = false;
     if (watcher.joinable()) watcher.join();
-
-    bool finished = chunk_manager_->IsFinished();
+    WaitForCheckpoint();
+    if (stream) {
+        writer_->Flush();
+        writer_->Close();
+        if (options_.resume) std::filesystem::remove(ResumePath());
+        if (!options_.quiet) UI::PrintStreamFallback();
+        return Stream(true);
+    }
+    // The decompressor may still be working through its queue.
+    if (finished && pipe_ && !pipe_->Finish()) {
+        finished = false;
+        error_ = pipe_->GetError();
+    }
     if (options_.resume) {
+        if (!finished && writer_->Sync()) RecordRanges(TakeUnsyncedRanges(engine));
         resume_state_.Save();
         if (finished) {
             std::filesystem::remove(ResumePath());
         }
     }
+    if (seed_owned_ && finished) std::filesystem::remove(seed_path_);
 
     auto end_time = std::chrono::steady_clock::now();
     std::chrono::duration<double> diff = end_time - start_time_;
     double avg_speed = diff.count() > 0 ? static_cast<double>(downloaded_size_) / diff.count() : 0.0;
 
-    UI::PrintFooter(finished, finished ? "" : "Could not complete download.");
-    UI::PrintSummary(total_size_, downloaded_size_, avg_speed, static_cast<long>(diff.count()), resumed_bytes_ > 0, resumed_bytes_, options_.num_threads);
+    if (!finished && error_.empty() && pipe_) error_ = pipe_->GetError();
+    if (!finished && error_.empty()) error_ = corrupt_ ? "A piece kept failing verification." : "Could not complete download.";
+    if (options_.quiet) return finished;
+
+    UI::PrintFooter(finished, error_);
+    UI::PrintSummary(total_size_, downloaded_size_, avg_speed, static_cast<long>(diff.count()), resumed_bytes_ > 0, resumed_bytes_, static_cast<int>(engine.GetPeakTransfers()));
+    if (all_urls.size() > 1) {
+        for (size_t i = 0; i < all_urls.size(); ++i) {
+            UI::PrintMirrorUsage(all_urls[i], engine.GetMirrors().GetBytes(i));
+        }
+    }
+    UI::PrintBufferUsage(options_.buffers->GetHighWater());
+    if (pipe_) UI::PrintReorderUsage(pipe_->GetPeakHeld());
+    if (finished && pipe_ && pipe_->GetStage()) UI::PrintDecompressed(pipe_->GetStage()->GetOutputBytes());
+    if (finished && hasher_ && options_.tree_digest) UI::PrintTreeDigest(hasher_->GetTreeDigest());
 
     return finished;
 }
 
-void Downloader::DownloadThread() {
-    NetworkOptions net_options = BuildNetworkOptions();
-    while (running_ && !chunk_manager_->IsFinished()) {
-        if (paused_) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
+std::string Downloader::GetFileDigest() const {
+    if (pipe_) return pipe_->GetDigest();
+    return hasher_ ? hasher_->GetFileDigest() : "";
+}
+
+bool Downloader::OnDataReceived(size_t offset, const char* data, size_t size) {
+    if (!writer_->WriteAt(offset, data, size)) {
+        // A pipe or decompressor that failed stays failed; retrying is no use.
+        if (pipe_) running_ = false;
+        return false;
+    }
+    if (pipe_) chunk_manager_->AdvanceWindow(pipe_->GetWritten());
+    if (hasher_) hasher_->Update(offset, data, size);
+    unrecorded_progress_ = true;
+    return true;
+}
+
+void Downloader::OnChunkDownloaded(Chunk* chunk, double speed) {
+    // Only count the chunk once its bytes have actually reached the file.
+    writer_->AfterPendingWrites([this, chunk, speed](bool written) {
+        if (written) {
+            OnChunkPersisted(chunk, speed);
+        } else {
+            running_ = false;
         }
+    });
+}
 
-        Chunk* chunk = chunk_manager_->GetNextChunk();
-        if (!chunk) break;
-
-        std::vector<char> buffer;
-        buffer.reserve(chunk->end - chunk->start + 1);
-
-        std::vector<std::string> all_urls = mirrors_;
-        all_urls.insert(all_urls.begin(), url_);
-
-        bool success = false;
-        double speed = 0.0;
-
-        for (int attempt = 0; attempt <= options_.retries && running_; ++attempt) {
-            for (const auto& current_url : all_urls) {
-                buffer.clear();
-                auto start_time = std::chrono::steady_clock::now();
-                std::string error;
-                if (NetworkLayer::DownloadChunk(current_url, chunk->start, chunk->end, buffer, net_options, &error)) {
-                    auto end_time = std::chrono::steady_clock::now();
-                    std::chrono::duration<double> diff = end_time - start_time;
-                    if (diff.count() > 0) {
-                        speed = buffer.size() / diff.count();
-                    }
-                    success = true;
-                    break;
-                }
-            }
-            if (success) break;
-            if (options_.retry_delay_ms > 0) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(options_.retry_delay_ms));
-            }
+void Downloader::OnChunkPersisted(Chunk* chunk, double speed) {
+    if (options_.resume) {
+        // Recorded by the first checkpoint whose sync covers it.
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        unsynced_.emplace_back(chunk->start, chunk->end);
+        unrecorded_progress_ = true;
+    }
+    chunk_manager_->MarkSuccess(chunk->id, speed);
+    if (hasher_) CheckPieces(chunk->start, chunk->end);
+}
+
+void Downloader::CheckPieces(size_t start, size_t end) {
+    std::vector<size_t> completed;
+    std::vector<size_t> failed;
+    hasher_->MarkWritten(start, end, &completed, &failed);
+
+    if (store_digests_) {
+        PieceHasher::Digest digest;
+        for (size_t piece : completed) {
+            if (hasher_->GetDigest(piece, &digest)) resume_state_.SetBlockDigest(piece, digest);
         }
+    }
 
-        if (success) {
-            writer_.WriteAt(chunk->start, buffer);
-            downloaded_size_ += buffer.size();
-            chunk_manager_->MarkSuccess(chunk->id, speed);
-            if (options_.resume) {
-                resume_state_.MarkCompleted(chunk->id);
-                resume_state_.MaybeSave();
-            }
-        } else {
-            chunk_manager_->MarkFailed(chunk->id);
+    // A bad piece goes straight back to the chunk manager. Data left over
+    // from an earlier run is fetched again without counting against it.
+    for (size_t piece : failed) {
+        size_t piece_start = hasher_->GetPieceStart(piece);
+        size_t piece_end = hasher_->GetPieceEnd(piece);
+        if (running_ && ++refetches_[piece] > options_.retries) {
+            corrupt_ = true;
+            running_ = false;
+        } else if (running_) {
+            UI::PrintPieceRefetch(piece, piece_start, piece_end);
+        }
+        RefetchPiece(piece);
+    }
+}
+
+void Downloader::RefetchPiece(size_t piece) {
+    size_t piece_start = hasher_->GetPieceStart(piece);
+    size_t piece_end = hasher_->GetPieceEnd(piece);
+    if (options_.resume) {
+        // A checkpoint under way must not record the piece once it is cleared.
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        if (checkpointing_) cleared_.emplace_back(piece_start, piece_end);
+        SubtractRange(unsynced_, piece_start, piece_end);
+        resume_state_.ClearRange(piece_start, piece_end);
+    }
+    chunk_manager_->ReopenRange(piece_start, piece_end);
+    reopened_pieces_++;
+    downloaded_size_ -= std::min<size_t>(downloaded_size_, piece_end - piece_start + 1);
+}
+
+void Downloader::AdoptExistingFile(size_t existing_size) {
+    // Without resume state, an existing copy of the right size is only worth
+    // keeping when the manifest can tell its good pieces from its bad ones.
+    if (resume_loaded_ || existing_size != total_size_ || !hasher_ || options_.piece_hashes.empty()) return;
+
+    MarkLocalRange(0, total_size_ - 1);
+    resumed_bytes_ = chunk_manager_->GetCompletedBytes();
+    downloaded_size_ = chunk_manager_->GetCompletedBytes();
+    UI::PrintExistingPieces(chunk_manager_->GetCompletedBytes(), total_size_);
+}
+
+void Downloader::PrepareSeed() {
+    if (!options_.delta) return;
+    std::error_code ec;
+    if (!options_.seed_path.empty() && !std::filesystem::equivalent(options_.seed_path, output_path_, ec)) {
+        seed_path_ = options_.seed_path;
+        return;
+    }
+
+    // The old version sits where the new one goes; move it aside so it can
+    // be read while the output is rewritten. A seed left by an interrupted
+    // run is picked up again.
+    std::string moved = output_path_ + ".fastget-seed";
+    if (!std::filesystem::exists(moved, ec)) {
+        // With resume state the output is a partial download, not a seed.
+        if (std::filesystem::exists(ResumePath(), ec) || !std::filesystem::exists(output_path_, ec)) return;
+        std::filesystem::rename(output_path_, moved, ec);
+        if (ec) return;
+    }
+    seed_path_ = moved;
+    seed_owned_ = true;
+}
+
+void Downloader::ReuseSeedBlocks() {
+    if (seed_path_.empty()) return;
+    std::vector<DeltaIndex::Copy> copies;
+    if (!options_.delta->FindBlocks(seed_path_, &copies)) return;
+
+    std::ifstream seed(seed_path_, std::ios::binary);
+    std::vector<char> buffer(kSeedCopyBufferSize);
+    for (const auto& copy : copies) {
+        for (size_t done = 0; done < copy.length;) {
+            size_t size = std::min(buffer.size(), copy.length - done);
+            seed.clear();
+            seed.seekg(static_cast<std::streamoff>(copy.source + done));
+            seed.read(buffer.data(), static_cast<std::streamsize>(size));
+            // A short last block may have matched against padding past the end.
+            std::fill(buffer.begin() + seed.gcount(), buffer.begin() + size, 0);
+            if (!writer_->WriteAt(copy.target + done, buffer.data(), size)) return;
+            if (hasher_) hasher_->Update(copy.target + done, buffer.data(), size);
+            done += size;
         }
     }
+    writer_->Flush();
+
+    size_t before = chunk_manager_->GetCompletedBytes();
+    for (const auto& copy : copies) {
+        MarkLocalRange(copy.target, copy.target + copy.length - 1);
+    }
+    size_t reused = chunk_manager_->GetCompletedBytes() - before;
+    resumed_bytes_ += reused;
+    downloaded_size_ += reused;
+    UI::PrintSeedReuse(reused, total_size_);
+}
+
+void Downloader::ApplyPrefix() {
+    if (prefix_.empty()) return;
+    size_t size = std::min(prefix_.size(), total_size_);
+    if (writer_->WriteAt(0, prefix_.data(), size)) {
+        if (hasher_) hasher_->Update(0, prefix_.data(), size);
+        writer_->Flush();
+        size_t before = chunk_manager_->GetCompletedBytes();
+        MarkLocalRange(0, size - 1);
+        downloaded_size_ += chunk_manager_->GetCompletedBytes() - before;
+    }
+    std::vector<char>().swap(prefix_);
+}
+
+// Bytes that reached the file without the transfer engine: an existing copy,
+// seed blocks or the probe's body.
+void Downloader::MarkLocalRange(size_t start, size_t end) {
+    if (options_.resume) resume_state_.MarkRangeCompleted(start, end);
+    chunk_manager_->MarkRangeCompleted(start, end);
+    if (hasher_) CheckPieces(start, end);
+}
+
+bool Downloader::RepairPieces() {
+    // A wrong whole-file digest costs another pass only when piece hashes can
+    // say which pieces are at fault.
+    if (repaired_ || options_.expected_digest.empty() || options_.piece_hashes.empty()) return false;
+    if (hasher_->GetFileDigest() == options_.expected_digest) return false;
+    repaired_ = true;
+
+    std::vector<size_t> failed;
+    hasher_->Recheck(&failed);
+    if (failed.empty()) {
+        hasher_->Finish();
+        return false;
+    }
+    for (size_t piece : failed) {
+        UI::PrintPieceRefetch(piece, hasher_->GetPieceStart(piece), hasher_->GetPieceEnd(piece));
+        RefetchPiece(piece);
+    }
+    return true;
+}
+
+void Downloader::Checkpoint(const TransferEngine& engine) {
+    if (!options_.resume || checkpointing_ || !resume_state_.IsSaveDue(unrecorded_progress_)) return;
+    WaitForCheckpoint();
+    checkpointing_ = true;
+    Ranges ranges = TakeUnsyncedRanges(engine);
+    // Data has to be durable before the checkpoint that claims it. The sync
+    // covers completed writes only, so an asynchronous writer first has to
+    // finish the ones issued so far; the loop does not wait for either.
+    writer_->AfterPendingWrites([this, ranges](bool written) {
+        if (!written) {
+            ReturnUnsynced(ranges);
+            checkpointing_ = false;
+            return;
+        }
+        checkpoint_thread_ = std::thread(&Downloader::SyncCheckpoint, this, ranges);
+    });
+}
+
+Downloader::Ranges Downloader::TakeUnsyncedRanges(const TransferEngine& engine) {
+    // On the loop thread, so `persisted` cannot move while it is read.
+    Ranges ranges;
+    {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        ranges.swap(unsynced_);
+        cleared_.clear();
+    }
+    engine.ForEachInFlightChunk([&ranges](Chunk* chunk) {
+        if (chunk->persisted <= chunk->checkpointed) return;
+        ranges.emplace_back(chunk->start + chunk->checkpointed, chunk->start + chunk->persisted - 1);
+        chunk->checkpointed = chunk->persisted;
+    });
+    unrecorded_progress_ = false;
+    return ranges;
+}
+
+void Downloader::SyncCheckpoint(Ranges ranges) {
+    if (writer_->SyncCompleted()) {
+        RecordRanges(std::move(ranges));
+        resume_state_.Save();
+    } else {
+        ReturnUnsynced(ranges);
+    }
+    checkpointing_ = false;
+}
+
+void Downloader::RecordRanges(Ranges ranges) {
+    std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+    for (const auto& [start, end] : cleared_) SubtractRange(ranges, start, end);
+    for (const auto& [start, end] : ranges) resume_state_.MarkRangeCompleted(start, end);
+}
+
+void Downloader::ReturnUnsynced(const Ranges& ranges) {
+    std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+    Ranges kept = ranges;
+    for (const auto& [start, end] : cleared_) SubtractRange(kept, start, end);
+    unsynced_.insert(unsynced_.end(), kept.begin(), kept.end());
+}
+
+void Downloader::WaitForCheckpoint() {
+    if (checkpoint_thread_.joinable()) checkpoint_thread_.join();
 }
 
 void Downloader::ProgressWatcher() {
     while (running_) {
         auto now = std::chrono::steady_clock::now();
         std::chrono::duration<double> diff = now - start_time_;
-        double total_speed = diff.count() > 0 ? downloaded_size_ / diff.count() : 0.0;
+        double total_speed = diff.count() > 0 ? (downloaded_size_ - resumed_bytes_) / diff.count() : 0.0;
 
-        UI::UpdateProgress(downloaded_size_, total_size_, total_speed, start_time_);
-
-        if (chunk_manager_->IsFinished()) break;
+        if (total_size_ > 0) {
+            UI::UpdateProgress(downloaded_size_, total_size_, total_speed, start_time_);
+        } else {
+            UI::UpdateStreamProgress(downloaded_size_, total_speed);
+        }
         std::this_thread::sleep_for(std::chrono::milliseconds(200));
     }
 }
 
 void Downloader::Pause() {
     paused_ = true;
-    if (options_.resume) {
+    if (!options_.resume) return;
+    bool synced = writer_->Sync();
+    if (streaming_) {
+        SaveStreamState(downloaded_size_, stream_validator_);
+    } else {
+        if (synced) {
+            std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+            for (const auto& [start, end] : unsynced_) resume_state_.MarkRangeCompleted(start, end);
+        }
         resume_state_.Save();
     }
 }
@@ -171,6 +566,170 @@ std::string Downloader::ResumePath() const {
     return output_path_ + ".fastget";
 }
 
+std::string Downloader::StreamStatePath() const {
+    return output_path_ + ".fastget-stream";
+}
+
+bool Downloader::Stream(bool fallback) {
+    // One plain GET, written in order. The writer has to grow the file as
+    // bytes arrive, which a mapping or an io_uring ring sized up front can't.
+    streaming_ = true;
+    hasher_.reset(); // a digest check falls back to reading the file
+    // Opened on the first good response, so a missing file leaves nothing behind.
+    if (!pipe_) writer_ = std::make_unique<FileWriter>(output_path_);
+    if (pipe_ && !fallback && !options_.expected_digest.empty()) pipe_->EnableDigest(Verifier::GetAlgorithm(options_.file_digest_type));
+    bool opened = false;
+
+    size_t offset = 0;
+    if (options_.resume && LoadStreamState(&offset, &stream_validator_)) {
+        offset = std::min(offset, writer_->Exists() ? writer_->GetSize() : 0);
+    } else {
+        stream_validator_.clear();
+        offset = 0;
+    }
+    downloaded_size_ = offset;
+    resumed_bytes_ = offset;
+
+    running_ = true;
+    start_time_ = std::chrono::steady_clock::now();
+    if (!options_.quiet && !fallback) UI::PrintHeader(output_path_, total_size_, 1);
+    std::thread watcher;
+    if (!options_.quiet) watcher = std::thread(&Downloader::ProgressWatcher, this);
+
+    std::vector<std::string> all_urls = mirrors_;
+    all_urls.insert(all_urls.begin(), url_);
+    NetworkOptions net_options = BuildNetworkOptions();
+    long long expected = -1;
+    std::string host;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
+    auto on_headers = [&](const NetworkLayer::StreamInfo& info) {
+        // A checkpoint of the previous response must not land after this one's.
+        WaitForCheckpoint();
+        if (!opened && !(opened = writer_->Open())) {
+            error_ = "Could not open " + output_path_ + " for writing.";
+            running_ = false;
+            return false;
+        }
+        if (info.offset != downloaded_size_ && pipe_) {
+            // What went out cannot be taken back. Sending it again is only
+            // harmless, and skipped by the pipe, if the file is the same one.
+            if (downloaded_size_ > 0 && (stream_validator_.empty() || info.validator != stream_validator_)) {
+                error_ = "The server restarted the file with different content.";
+                running_ = false;
+                return false;
+            }
+            downloaded_size_ = 0;
+        } else if (info.offset != downloaded_size_) {
+            // The entity changed, or the server would not resume: start over.
+            if (!writer_->Truncate(0)) return false;
+            downloaded_size_ = 0;
+            resumed_bytes_ = 0;
+        }
+        stream_validator_ = info.validator;
+        expected = info.length >= 0 ? static_cast<long long>(downloaded_size_) + info.length : -1;
+        if (options_.resume) SaveStreamState(downloaded_size_, stream_validator_);
+        return true;
+    };
+    auto on_data = [&](const char* data, size_t size) {
+        while (options_.limiter && running_ && !options_.limiter->TryAcquire(host, size)) {
+            std::this_thread::sleep_for(options_.limiter->GetWait(host));
+        }
+        if (!writer_->WriteAt(downloaded_size_, data, size)) {
+            if (pipe_) running_ = false;
+            return false;
+        }
+        downloaded_size_ += size;
+        auto now = std::chrono::steady_clock::now();
+        if (options_.resume && !checkpointing_ && now - last_checkpoint >= kStreamCheckpointInterval) {
+            // Synced off the transfer thread, like the range path's checkpoints.
+            WaitForCheckpoint();
+            checkpointing_ = true;
+            checkpoint_thread_ = std::thread([this, bytes = downloaded_size_.load(), validator = stream_validator_]() {
+                if (writer_->SyncCompleted()) SaveStreamState(bytes, validator);
+                checkpointing_ = false;
+            });
+            last_checkpoint = now;
+        }
+        return true;
+    };
+
+    // A mirror that does not share the validator answers a resume in full.
+    bool finished = false;
+    size_t attempts = all_urls.size() * static_cast<size_t>(options_.retries + 1);
+    for (size_t attempt = 0; attempt < attempts && running_ && !finished; ++attempt) {
+        if (attempt > 0 && attempt % all_urls.size() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options_.retry_delay_ms));
+        }
+        const std::string& url = all_urls[attempt % all_urls.size()];
+        host = NetworkLayer::GetHost(url);
+        expected = -1;
+        finished = NetworkLayer::StreamGet(url, net_options, downloaded_size_, stream_validator_,
+                                           running_, on_headers, on_data);
+        if (finished && expected >= 0 && static_cast<size_t>(expected) != downloaded_size_) finished = false;
+    }
+
+    WaitForCheckpoint();
+    size_t written = downloaded_size_;
+    if (finished && options_.expected_size > 0 && written != options_.expected_size) {
+        finished = false;
+        error_ = "Received " + std::to_string(written) + " bytes, expected " + std::to_string(options_.expected_size) + ".";
+    }
+    if (finished) finished = writer_->Truncate(written) && writer_->Sync();
+    if (finished && pipe_ && !pipe_->Finish()) {
+        finished = false;
+        error_ = pipe_->GetError();
+    }
+    if (!opened && error_.empty()) error_ = "No usable response from the server.";
+
+    running_ = false;
+    if (watcher.joinable()) watcher.join();
+    if (finished) {
+        total_size_ = written;
+        std::filesystem::remove(StreamStatePath());
+    } else if (opened && options_.resume && !stream_validator_.empty() && writer_->Sync()) {
+        SaveStreamState(written, stream_validator_);
+    }
+    writer_->Close();
+
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start_time_;
+    double avg_speed = diff.count() > 0 ? static_cast<double>(written - resumed_bytes_) / diff.count() : 0.0;
+    if (!finished && error_.empty() && pipe_) error_ = pipe_->GetError();
+    if (!finished && error_.empty()) error_ = "Could not complete download.";
+    if (options_.quiet) return finished;
+
+    UI::PrintFooter(finished, error_);
+    UI::PrintSummary(written, written - resumed_bytes_, avg_speed, static_cast<long>(diff.count()), resumed_bytes_ > 0, resumed_bytes_, 1);
+    if (finished && pipe_ && pipe_->GetStage()) UI::PrintDecompressed(pipe_->GetStage()->GetOutputBytes());
+    return finished;
+}
+
+void Downloader::SaveStreamState(size_t bytes, const std::string& validator) {
+    // Without a validator a resumed stream could splice two versions together.
+    if (validator.empty()) return;
+    std::string temp = StreamStatePath() + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << kStreamMagic << "\n" << bytes << "\n" << validator << "\n";
+        if (!out) return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, StreamStatePath(), ec);
+}
+
+bool Downloader::LoadStreamState(size_t* bytes, std::string* validator) const {
+    std::ifstream in(StreamStatePath());
+    std::string magic, count;
+    if (!std::getline(in, magic) || magic != kStreamMagic) return false;
+    if (!std::getline(in, count) || !std::getline(in, *validator) || validator->empty()) return false;
+    try {
+        *bytes = static_cast<size_t>(std::stoull(count));
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
 NetworkOptions Downloader::BuildNetworkOptions() const {
     NetworkOptions options;
     options.timeout_ms = options_.timeout_ms;
@@ -178,45 +737,72 @@ NetworkOptions Downloader::BuildNetworkOptions() const {
     options.verify_tls = options_.verify_tls;
     options.user_agent = options_.user_agent;
     options.headers = options_.headers;
-    if (options_.max_rate > 0) {
-        int threads = options_.num_threads > 0 ? options_.num_threads : 1;
-        options.max_speed = options_.max_rate / static_cast<size_t>(threads);
-        if (options.max_speed == 0) options.max_speed = options_.max_rate;
-    }
+    options.share = options_.share ? options_.share->Handle() : nullptr;
     return options;
 }
 
 void Downloader::InitializeResumeState() {
-    size_t chunk_size = 1024 * 1024;
+    size_t chunk_size = options_.piece_size > 0 ? options_.piece_size : 1024 * 1024;
     size_t saved_chunk_size = 0;
     size_t saved_chunk_count = 0;
 
     if (options_.resume && resume_state_.Load(total_size_, &saved_chunk_size, &saved_chunk_count)) {
         if (saved_chunk_size > 0) chunk_size = saved_chunk_size;
         chunk_manager_ = std::make_unique<ChunkManager>(total_size_, chunk_size);
-        return;
+        // The saved bitmap only applies if it describes the same block grid.
+        if (chunk_manager_->GetBlockSize() == saved_chunk_size && chunk_manager_->GetBlockCount() == saved_chunk_count) {
+            resume_loaded_ = true;
+            return;
+        }
     }
 
     chunk_manager_ = std::make_unique<ChunkManager>(total_size_, chunk_size);
     if (options_.resume && chunk_manager_) {
-        resume_state_.Initialize(total_size_, chunk_manager_->GetChunkSize(), chunk_manager_->GetTotalChunks());
+        resume_state_.Initialize(total_size_, chunk_manager_->GetBlockSize(), chunk_manager_->GetBlockCount());
     }
 }
 
 void Downloader::ApplyResumeState() {
     if (!options_.resume || !chunk_manager_) return;
-    auto completed = resume_state_.GetCompletedChunks();
-    size_t resumed_bytes = 0;
-    for (size_t chunk_id : completed) {
-        size_t start = 0;
-        size_t end = 0;
-        if (chunk_manager_->GetChunkRange(chunk_id, start, end)) {
-            resumed_bytes += (end - start + 1);
-            chunk_manager_->MarkCompleted(chunk_id);
+    if (store_digests_) {
+        for (const auto& [block, digest] : resume_state_.GetBlockDigests()) {
+            hasher_->SetDigest(block, digest);
         }
     }
+    for (const auto& [start, end] : resume_state_.GetCompletedRanges()) {
+        chunk_manager_->MarkRangeCompleted(start, end);
+        if (hasher_) CheckPieces(start, end);
+    }
+    size_t resumed_bytes = chunk_manager_->GetCompletedBytes();
     resumed_bytes_ = resumed_bytes;
     downloaded_size_ = resumed_bytes;
 }
 
+bool Downloader::InitializeHasher() {
+    if (pipe_) {
+        // Pieces cannot be read back from a pipe; the whole-file digest is
+        // taken as the bytes go out.
+        if (!options_.expected_digest.empty()) pipe_->EnableDigest(Verifier::GetAlgorithm(options_.file_digest_type));
+        return true;
+    }
+    bool verify = !options_.piece_hashes.empty();
+    if (!verify && options_.expected_digest.empty() && !options_.tree_digest) return true;
+
+    size_t piece_size = verify ? options_.piece_size : chunk_manager_->GetBlockSize();
+    hasher_ = std::make_unique<PieceHasher>(output_path_, total_size_, piece_size);
+    if (verify) {
+        if (hasher_->GetPieceCount() != options_.piece_hashes.size()) {
+            std::cerr << "Piece manifest lists " << options_.piece_hashes.size() << " pieces, the file has "
+                      << hasher_->GetPieceCount() << std::endl;
+            return false;
+        }
+        hasher_->SetExpected(options_.piece_hashes);
+    }
+    if (!options_.expected_digest.empty()) hasher_->EnableFileDigest(options_.file_digest_type);
+    // Resume state keys digests by block, so they only carry over when
+    // pieces and blocks line up.
+    store_digests_ = options_.resume && piece_size == chunk_manager_->GetBlockSize();
+    return true;
+}
+
 }
@@ -1,48 +1,128 @@
 #pragma once
 #include "network.hpp"
 #include "file_writer.hpp"
+#include "uring_file_writer.hpp"
+#include "pipe_writer.hpp"
+#include "decompressor.hpp"
 #include "chunk_manager.hpp"
 #include "ui.hpp"
 #include "resume_state.hpp"
+#include "transfer_engine.hpp"
+#include "piece_hasher.hpp"
+#include "delta_index.hpp"
+#include "verifier.hpp"
 #include <string>
 #include <vector>
 #include <thread>
+#include <chrono>
 #include <atomic>
 #include <memory>
+#include <map>
+#include <mutex>
+#include <utility>
 
 namespace fastget {
 
 struct DownloadOptions {
-    int num_threads = 8;
-    size_t max_rate = 0;
+    int num_threads = 0;      // fixed connection count; 0 adapts up to max_connections
+    int max_connections = 32;
+    int max_per_mirror = 0;
+    size_t max_rate = 0; // only used when no shared limiter is given
     int retries = 2;
     int retry_delay_ms = 500;
     long timeout_ms = 0;
     long connect_timeout_ms = 0;
     bool verify_tls = false;
     bool resume = true;
+    bool buffered = false;
+    bool mmap_output = false;
+    bool io_uring = false;
     std::vector<std::string> headers;
     std::string user_agent;
+    NetworkShare* share = nullptr;
+    BufferPool* buffers = nullptr;
+    RateLimiter* limiter = nullptr;
+
+    size_t expected_size = 0; // e.g. from a manifest; 0 takes whatever the server reports
+
+    // Piece hashing; any of these hashes the download as it is written.
+    std::string expected_digest; // lowercase hex whole-file digest, see Downloader::GetFileDigest
+    Verifier::HashType file_digest_type = Verifier::HashType::SHA256;
+    bool tree_digest = false; // print the Merkle root of the piece digests
+    size_t piece_size = 0;    // piece grid of `piece_hashes`
+    std::vector<PieceHasher::Digest> piece_hashes; // expected SHA-256 per piece
+
+    // Delta download: blocks of `delta` found in the seed are copied instead
+    // of fetched. The seed defaults to an existing output file.
+    const DeltaIndex* delta = nullptr;
+    std::string seed_path;
+
+    bool quiet = false; // no progress or summary output; a batch reports for itself
+    bool fast_start = false; // probe with an open-ended GET and keep its body, see Probe()
+
+    // An output path of "-" sends the file to stdout in order; ranges may run
+    // at most this far ahead of the bytes already sent.
+    size_t reorder_window = 64 * 1024 * 1024;
+    // Decompress gzip, xz or zstd on the fly and write only the result to
+    // the output path, which may be "-". Implies the in-order path above.
+    bool decompress = false;
 };
 
 class Downloader {
 public:
     Downloader(const std::string& url, const std::vector<std::string>& mirrors, const std::string& output_path, const DownloadOptions& options);
+    ~Downloader();
     
+    // Asks the server for the file size. Start() probes on its own if this
+    // has not happened yet; a batch calls it ahead of time on other threads.
+    // With options.fast_start the probe is the first range request itself:
+    // a small file arrives whole and a large one keeps the first bytes.
+    bool Probe();
+    // Caps the connections Start() may open, e.g. to a share of a batch budget.
+    void LimitConnections(int connections);
     bool Start();
     void Pause();
     void Resume();
 
     size_t GetTotalSize() const { return total_size_; }
     size_t GetDownloadedSize() const { return downloaded_size_; }
+    const std::string& GetUrl() const { return url_; }
+    const std::string& GetOutputPath() const { return output_path_; }
+    // Why the last Start() failed.
+    const std::string& GetError() const { return error_; }
+    // Filled in by a successful Start() when options.expected_digest is set.
+    std::string GetFileDigest() const;
 
 private:
-    void DownloadThread();
+    bool OnDataReceived(size_t offset, const char* data, size_t size);
+    void OnChunkDownloaded(Chunk* chunk, double speed);
+    void OnChunkPersisted(Chunk* chunk, double speed);
+    using Ranges = std::vector<std::pair<size_t, size_t>>;
+    void Checkpoint(const TransferEngine& engine);
+    Ranges TakeUnsyncedRanges(const TransferEngine& engine);
+    void SyncCheckpoint(Ranges ranges);
+    void RecordRanges(Ranges ranges);
+    void ReturnUnsynced(const Ranges& ranges);
+    void WaitForCheckpoint();
     void ProgressWatcher();
     std::string ResumePath() const;
     NetworkOptions BuildNetworkOptions() const;
     void InitializeResumeState();
     void ApplyResumeState();
+    bool InitializeHasher();
+    void CheckPieces(size_t start, size_t end);
+    void RefetchPiece(size_t piece);
+    void AdoptExistingFile(size_t existing_size);
+    bool RepairPieces();
+    void PrepareSeed();
+    void ReuseSeedBlocks();
+    void ApplyPrefix();
+    void MarkLocalRange(size_t start, size_t end);
+    // `fallback`: the header is already out, the range path gave up.
+    bool Stream(bool fallback = false);
+    std::string StreamStatePath() const;
+    void SaveStreamState(size_t bytes, const std::string& validator);
+    bool LoadStreamState(size_t* bytes, std::string* validator) const;
 
     std::string url_;
     std::vector<std::string> mirrors_;
@@ -50,16 +130,45 @@ private:
     DownloadOptions options_;
     
     size_t total_size_ = 0;
+    bool probed_ = false;
+    std::vector<char> prefix_; // file bytes from offset 0 read by the probe
+    std::string error_;
     std::atomic<size_t> downloaded_size_{0};
     std::atomic<bool> running_{false};
     std::atomic<bool> paused_{false};
 
-    FileWriter writer_;
+    std::unique_ptr<NetworkShare> owned_share_;
+    std::unique_ptr<BufferPool> owned_buffers_;
+    std::unique_ptr<RateLimiter> owned_limiter_;
+    std::unique_ptr<FileWriter> writer_;
+    PipeWriter* pipe_ = nullptr; // writer_ when the output is stdout or a decompressor
     std::unique_ptr<ChunkManager> chunk_manager_;
-    std::vector<std::thread> threads_;
     std::chrono::steady_clock::time_point start_time_;
     ResumeState resume_state_;
     std::atomic<size_t> resumed_bytes_{0};
+    bool unrecorded_progress_ = false; // in-flight chunks moved `persisted` since the last checkpoint
+
+    // Checkpoints sync the output on their own thread. Ranges written since
+    // the last one wait here until a sync covers them.
+    std::thread checkpoint_thread_;
+    std::atomic<bool> checkpointing_{false};
+    std::mutex checkpoint_mutex_;
+    Ranges unsynced_;
+    Ranges cleared_; // refetched while a checkpoint was under way
+
+    std::unique_ptr<PieceHasher> hasher_;
+    bool store_digests_ = false; // piece grid matches the resume block grid
+    std::map<size_t, int> refetches_;
+    size_t reopened_pieces_ = 0;
+    bool corrupt_ = false;
+    bool repaired_ = false;
+    bool resume_loaded_ = false;
+
+    std::string seed_path_;
+    bool seed_owned_ = false; // the old output moved aside, removed once done
+
+    bool streaming_ = false;
+    std::string stream_validator_; // what a resumed stream is checked against with If-Range
 };
 
 }
@@ -1,6 +1,17 @@
 #include "file_writer.hpp"
+#include <algorithm>
 #include <filesystem>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#endif
+
 namespace fastget {
 
 FileWriter::FileWriter(const std::string& filename) : filename_(filename) {}
@@ -9,6 +20,8 @@ FileWriter::~FileWriter() {
     Close();
 }
 
+#ifdef _WIN32
+
 bool FileWriter::Open() {
     file_.open(filename_, std::ios::in | std::ios::out | std::ios::binary);
     if (!file_.is_open()) {
@@ -29,14 +42,20 @@ void FileWriter::PreAllocate(size_t size) {
     file_.flush();
 }
 
-bool FileWriter::WriteAt(size_t offset, const std::vector<char>& data) {
+bool FileWriter::WriteAt(size_t offset, const char* data, size_t size) {
     std::lock_guard<std::mutex> lock(write_mutex_);
     if (!file_.is_open()) return false;
 
     file_.seekp(offset);
-    file_.write(data.data(), data.size());
+    file_.write(data, size);
+    return static_cast<bool>(file_);
+}
+
+bool FileWriter::Sync() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!file_.is_open()) return false;
     file_.flush();
-    return true;
+    return static_cast<bool>(file_);
 }
 
 void FileWriter::Close() {
@@ -45,6 +64,140 @@ void FileWriter::Close() {
     }
 }
 
+bool FileWriter::Truncate(size_t size) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!file_.is_open()) return false;
+    // fstream cannot resize an open file.
+    file_.close();
+    std::error_code ec;
+    std::filesystem::resize_file(filename_, size, ec);
+    file_.open(filename_, std::ios::in | std::ios::out | std::ios::binary);
+    return !ec && file_.is_open();
+}
+
+#else
+
+bool FileWriter::Open() {
+    if (fd_ >= 0) return true;
+    fd_ = ::open(filename_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    return fd_ >= 0;
+}
+
+void FileWriter::PreAllocate(size_t size) {
+    if (fd_ < 0 || GetSize() >= size) return;
+#ifdef __linux__
+    if (fallocate(fd_, 0, 0, static_cast<off_t>(size)) == 0) return;
+#endif
+    if (ftruncate(fd_, static_cast<off_t>(size)) != 0) return;
+}
+
+bool FileWriter::WriteAt(size_t offset, const char* data, size_t size) {
+    if (fd_ < 0) return false;
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd_, data, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        offset += static_cast<size_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool FileWriter::Sync() {
+    if (fd_ < 0) return false;
+#ifdef __linux__
+    return fdatasync(fd_) == 0;
+#else
+    return fsync(fd_) == 0;
+#endif
+}
+
+void FileWriter::Close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool FileWriter::Truncate(size_t size) {
+    if (fd_ < 0) return false;
+    return ftruncate(fd_, static_cast<off_t>(size)) == 0;
+}
+
+MappedFileWriter::MappedFileWriter(const std::string& filename)
+    : FileWriter(filename), dirty_begin_(std::numeric_limits<size_t>::max()) {}
+
+MappedFileWriter::~MappedFileWriter() {
+    Close();
+}
+
+void MappedFileWriter::PreAllocate(size_t size) {
+    FileWriter::PreAllocate(size);
+    if (fd_ < 0 || map_ || size == 0) return;
+    // Touching a mapped page past the end of the file raises SIGBUS, so if
+    // the file could not be grown, stay on pwrite.
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < size) return;
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) return;
+    map_ = static_cast<char*>(map);
+    map_size_ = size;
+    // Pages are only ever overwritten, so faulting in neighbours is wasted work.
+    madvise(map_, map_size_, MADV_RANDOM);
+}
+
+bool MappedFileWriter::WriteAt(size_t offset, const char* data, size_t size) {
+    if (!map_) return FileWriter::WriteAt(offset, data, size);
+    if (offset > map_size_ || size > map_size_ - offset) return false;
+
+    std::memcpy(map_ + offset, data, size);
+
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    dirty_begin_ = std::min(dirty_begin_, offset);
+    dirty_end_ = std::max(dirty_end_, offset + size);
+    return true;
+}
+
+bool MappedFileWriter::Sync() {
+    if (!map_) return FileWriter::Sync();
+
+    size_t begin, end;
+    {
+        std::lock_guard<std::mutex> lock(dirty_mutex_);
+        begin = dirty_begin_;
+        end = dirty_end_;
+        dirty_begin_ = std::numeric_limits<size_t>::max();
+        dirty_end_ = 0;
+    }
+    if (begin >= end) return true;
+
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    begin -= begin % page_size;
+    if (msync(map_ + begin, end - begin, MS_SYNC) != 0) return false;
+    // Checkpointed pages stay in the page cache; drop them from our mapping to keep RSS flat.
+    madvise(map_ + begin, end - begin, MADV_DONTNEED);
+    return true;
+}
+
+void MappedFileWriter::Close() {
+    if (map_) {
+        munmap(map_, map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+    FileWriter::Close();
+}
+
+#endif
+
+bool FileWriter::WriteAt(size_t offset, const std::vector<char>& data) {
+    return WriteAt(offset, data.data(), data.size());
+}
+
 bool FileWriter::Exists() const {
     return std::filesystem::exists(filename_);
 }
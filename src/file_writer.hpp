@@ -1,28 +1,86 @@
 #pragma once
 #include <string>
-#include <fstream>
-#include <mutex>
 #include <vector>
+#include <functional>
+#include <mutex>
+
+#ifdef _WIN32
+#include <fstream>
+#endif
 
 namespace fastget {
 
+// On POSIX systems writes go through pwrite on a raw descriptor, so there is
+// no shared seek position and no lock on the hot path. Durability is left to
+// Sync(), which callers batch at resume checkpoints.
 class FileWriter {
 public:
     FileWriter(const std::string& filename);
-    ~FileWriter();
+    virtual ~FileWriter();
 
-    bool Open();
-    void PreAllocate(size_t size);
+    virtual bool Open();
+    virtual void PreAllocate(size_t size);
     bool WriteAt(size_t offset, const std::vector<char>& data);
-    void Close();
+    virtual bool WriteAt(size_t offset, const char* data, size_t size);
+    virtual bool Sync();
+    // Makes the writes that have already completed durable, without waiting
+    // for any still in flight. Safe to call from a thread other than the
+    // writing one, so a checkpoint can sync while transfers go on.
+    virtual bool SyncCompleted() { return Sync(); }
+    virtual void Close();
+    // Cuts the file to `size` bytes, e.g. once a stream of unknown length ends.
+    virtual bool Truncate(size_t size);
+
+    // Asynchronous backends complete writes later. `done` runs once every
+    // write issued so far has reached the file (immediately for synchronous
+    // writers), with false if any of them failed.
+    virtual void AfterPendingWrites(std::function<void(bool)> done) { done(true); }
+    virtual void Poll() {}
+    virtual void Flush() {}
+    // True while an asynchronous backend has no room for more writes without
+    // waiting on the disk; transfers hold off until it clears.
+    virtual bool IsBacklogged() { return false; }
 
     bool Exists() const;
     size_t GetSize() const;
 
-private:
+protected:
     std::string filename_;
+#ifdef _WIN32
     std::fstream file_;
     std::mutex write_mutex_;
+#else
+    int fd_ = -1;
+#endif
+};
+
+#ifndef _WIN32
+
+// Maps the preallocated output so received spans are copied straight into
+// the page cache, with no syscall per write and no staging copy. Sync()
+// flushes only the range dirtied since the previous checkpoint.
+class MappedFileWriter : public FileWriter {
+public:
+    explicit MappedFileWriter(const std::string& filename);
+    ~MappedFileWriter() override;
+
+    using FileWriter::WriteAt;
+
+    void PreAllocate(size_t size) override;
+    bool WriteAt(size_t offset, const char* data, size_t size) override;
+    bool Sync() override;
+    void Close() override;
+
+private:
+    char* map_ = nullptr;
+    size_t map_size_ = 0;
+    // Range written since the last Sync(); one lock keeps both ends
+    // consistent, so a Sync() never takes half of a concurrent write.
+    std::mutex dirty_mutex_;
+    size_t dirty_begin_;
+    size_t dirty_end_ = 0;
 };
 
+#endif
+
 }
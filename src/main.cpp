@@ -1,5 +1,8 @@
 #include "downloader.hpp"
 #include "verifier.hpp"
+#include "manifest.hpp"
+#include "delta_index.hpp"
+#include "batch_scheduler.hpp"
 #include "ui.hpp"
 #include <iostream>
 #include <string>
@@ -10,6 +13,9 @@
 #include <filesystem>
 #include <algorithm>
 #include <cctype>
+#include <iterator>
+#include <set>
+#include <cstring>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -21,6 +27,7 @@
 using namespace fastget;
 
 Downloader* global_downloader = nullptr;
+BatchScheduler* global_batch = nullptr;
 
 static std::string Trim(const std::string& value) {
     size_t start = 0;
@@ -58,19 +65,75 @@ static size_t ParseSize(const std::string& value) {
     return static_cast<size_t>(number * multiplier);
 }
 
+// The name a file has once decompressed, e.g. data.tar for data.tar.gz or data.tgz.
+static std::string DecompressedName(const std::string& name) {
+    static const std::pair<const char*, const char*> kSuffixes[] = {
+        {".tgz", ".tar"}, {".txz", ".tar"}, {".tzst", ".tar"}, {".gz", ""}, {".xz", ""}, {".zst", ""}};
+    for (const auto& [suffix, replacement] : kSuffixes) {
+        size_t length = std::strlen(suffix);
+        if (name.size() > length && name.compare(name.size() - length, length, suffix) == 0) {
+            return name.substr(0, name.size() - length) + replacement;
+        }
+    }
+    return name;
+}
+
+// Gives every URL of a batch its own output file; a name that comes up again
+// gets a numeric suffix, e.g. file.bin.1.
+static std::vector<std::string> OutputPaths(const std::vector<std::string>& urls, const std::string& output, const std::string& output_dir, bool decompress) {
+    std::vector<std::string> paths;
+    std::set<std::string> used;
+    for (const auto& url : urls) {
+        std::string path = output;
+        if (path.empty()) {
+            std::string name = BaseNameFromUrl(url);
+            if (decompress) name = DecompressedName(name);
+            path = output_dir.empty() ? name : (std::filesystem::path(output_dir) / name).string();
+        }
+        std::string unique = path;
+        for (int n = 1; used.count(unique); ++n) unique = path + "." + std::to_string(n);
+        used.insert(unique);
+        paths.push_back(unique);
+    }
+    return paths;
+}
+
+static std::string HashName(Verifier::HashType type) {
+    switch (type) {
+        case Verifier::HashType::MD5: return "MD5";
+        case Verifier::HashType::SHA1: return "SHA-1";
+        case Verifier::HashType::SHA512: return "SHA-512";
+        case Verifier::HashType::SHA256:
+        default: return "SHA-256";
+    }
+}
+
 static void PrintUsage() {
     std::cout << "Usage: fastget <url> [options]\n"
               << "Options:\n"
               << "  --output <path>         Specify output file path\n"
               << "  --output-dir <path>     Directory for output files\n"
-              << "  --threads <n>           Number of download threads\n"
+              << "  --threads <n>           Use a fixed number of parallel connections\n"
+              << "  --max-connections <n>   Upper bound for adaptive connection count (default 32); in a batch, for all files together\n"
+              << "  --max-per-host <n>      Cap connections to any one host across a batch\n"
               << "  --mirrors <urls>        Comma-separated list of mirror URLs\n"
+              << "  --max-per-mirror <n>    Cap concurrent connections to any one mirror\n"
               << "  --sha256 <hash>         Verify SHA-256 checksum\n"
               << "  --md5 <hash>            Verify MD5 checksum\n"
               << "  --sha1 <hash>           Verify SHA-1 checksum\n"
               << "  --sha512 <hash>         Verify SHA-512 checksum\n"
+              << "  --manifest <file>       Take URLs, size and hashes from a Metalink or text manifest\n"
+              << "  --piece-hashes <file>   Check each piece against a manifest's SHA-256 pieces as it arrives\n"
+              << "  --tree-digest           Print the SHA-256 Merkle root of the pieces\n"
+              << "  --delta <file|url>      Fetch only the blocks of a zsync index that the seed lacks\n"
+              << "  --seed <file>           Old version to copy blocks from (default: the output file)\n"
               << "  --input <file>          File containing URLs (one per line)\n"
-              << "  --max-rate <rate>       Cap speed (e.g. 2m, 500k)\n"
+              << "  --fast-start            Size files from the first ranged GET instead of a HEAD; small files finish on it\n"
+              << "  --reorder-window <size> With --output - or --decompress, how far ranges may run ahead of the bytes consumed (default 64m)\n"
+              << "  --decompress            Decompress .gz/.xz/.zst while downloading and save only the result\n"
+              << "  --max-rate <rate>       Cap total speed across all connections (e.g. 2m, 500k)\n"
+              << "  --rate-burst <size>     Burst allowance for --max-rate (default 0.1s worth)\n"
+              << "  --host-rate <host=rate> Additional cap for one host (repeatable)\n"
               << "  --retries <n>           Retry failed chunks\n"
               << "  --retry-delay <ms>      Delay between retries\n"
               << "  --timeout <ms>          Transfer timeout\n"
@@ -79,14 +142,23 @@ static void PrintUsage() {
               << "  --user-agent <value>    Custom user agent\n"
               << "  --secure                Enable TLS verification\n"
               << "  --no-resume             Disable resume state\n"
+              << "  --buffered              Hold whole chunks in memory before writing\n"
+              << "  --mmap                  Write through a memory mapping of the output\n"
+              << "  --io-uring              Submit disk writes asynchronously via io_uring (Linux)\n"
+              << "  --huge-pages            Back transfer buffers with huge pages when available\n"
+              << "  --max-memory <size>     Cap memory held in transfer buffers (e.g. 256m)\n"
               << "  --help                  Show help" << std::endl;
 }
 
 static void signalHandler(int signum) {
     if (global_downloader) {
-        std::cout << "\nPausing download safely..." << std::endl;
+        std::cerr << "\nPausing download safely..." << std::endl;
         global_downloader->Pause();
     }
+    if (global_batch) {
+        std::cerr << "\nPausing downloads safely..." << std::endl;
+        global_batch->Pause();
+    }
     curl_global_cleanup();
     exit(signum);
 }
@@ -112,12 +184,22 @@ int main(int argc, char* argv[]) {
     std::vector<std::string> urls;
     std::string output;
     std::string output_dir;
-    int threads = 8;
+    int threads = 0;
+    int max_connections = 32;
+    int max_per_host = 0;
+    int max_per_mirror = 0;
     std::string expected_hash;
     Verifier::HashType hash_type = Verifier::HashType::SHA256;
     std::string hash_name = "SHA-256";
+    std::string manifest_path;
+    std::string piece_hashes_path;
+    bool tree_digest = false;
+    std::string delta_path;
+    std::string seed_path;
     std::vector<std::string> mirrors;
     size_t max_rate = 0;
+    size_t rate_burst = 0;
+    std::vector<std::pair<std::string, size_t>> host_rates;
     int retries = 2;
     int retry_delay_ms = 500;
     long timeout_ms = 0;
@@ -126,6 +208,14 @@ int main(int argc, char* argv[]) {
     std::string user_agent;
     bool verify_tls = false;
     bool resume = true;
+    bool buffered = false;
+    bool mmap_output = false;
+    bool io_uring = false;
+    bool huge_pages = false;
+    bool fast_start = false;
+    size_t reorder_window = 0;
+    bool decompress = false;
+    size_t max_memory = 0;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -139,6 +229,12 @@ int main(int argc, char* argv[]) {
             output_dir = argv[++i];
         } else if (arg == "--threads" && i + 1 < argc) {
             threads = std::stoi(argv[++i]);
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            max_connections = std::stoi(argv[++i]);
+        } else if (arg == "--max-per-host" && i + 1 < argc) {
+            max_per_host = std::stoi(argv[++i]);
+        } else if (arg == "--max-per-mirror" && i + 1 < argc) {
+            max_per_mirror = std::stoi(argv[++i]);
         } else if (arg == "--mirrors" && i + 1 < argc) {
             std::string mirrors_arg = argv[++i];
             std::stringstream ss(mirrors_arg);
@@ -163,6 +259,16 @@ int main(int argc, char* argv[]) {
             expected_hash = argv[++i];
             hash_type = Verifier::HashType::SHA512;
             hash_name = "SHA-512";
+        } else if (arg == "--manifest" && i + 1 < argc) {
+            manifest_path = argv[++i];
+        } else if (arg == "--piece-hashes" && i + 1 < argc) {
+            piece_hashes_path = argv[++i];
+        } else if (arg == "--tree-digest") {
+            tree_digest = true;
+        } else if (arg == "--delta" && i + 1 < argc) {
+            delta_path = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed_path = argv[++i];
         } else if (arg == "--input" && i + 1 < argc) {
             std::ifstream input(argv[++i]);
             std::string line;
@@ -172,6 +278,17 @@ int main(int argc, char* argv[]) {
             }
         } else if (arg == "--max-rate" && i + 1 < argc) {
             max_rate = ParseSize(argv[++i]);
+        } else if (arg == "--rate-burst" && i + 1 < argc) {
+            rate_burst = ParseSize(argv[++i]);
+        } else if (arg == "--host-rate" && i + 1 < argc) {
+            std::string value = argv[++i];
+            size_t eq = value.find('=');
+            if (eq == std::string::npos || eq == 0) {
+                std::cerr << "--host-rate expects <host>=<rate>" << std::endl;
+                curl_global_cleanup();
+                return 1;
+            }
+            host_rates.emplace_back(Trim(value.substr(0, eq)), ParseSize(value.substr(eq + 1)));
         } else if (arg == "--retries" && i + 1 < argc) {
             retries = std::stoi(argv[++i]);
         } else if (arg == "--retry-delay" && i + 1 < argc) {
@@ -188,11 +305,105 @@ int main(int argc, char* argv[]) {
             verify_tls = true;
         } else if (arg == "--no-resume") {
             resume = false;
+        } else if (arg == "--buffered") {
+            buffered = true;
+        } else if (arg == "--mmap") {
+            mmap_output = true;
+        } else if (arg == "--io-uring") {
+            io_uring = true;
+        } else if (arg == "--huge-pages") {
+            huge_pages = true;
+        } else if (arg == "--fast-start") {
+            fast_start = true;
+        } else if (arg == "--decompress") {
+            decompress = true;
+        } else if (arg == "--reorder-window" && i + 1 < argc) {
+            reorder_window = ParseSize(argv[++i]);
+        } else if (arg == "--max-memory" && i + 1 < argc) {
+            max_memory = ParseSize(argv[++i]);
         } else if (!arg.empty() && arg[0] != '-') {
             urls.push_back(arg);
         }
     }
 
+    size_t expected_size = 0;
+    size_t piece_size = 0;
+    std::vector<PieceHasher::Digest> piece_hashes;
+    if (!manifest_path.empty()) {
+        Manifest manifest;
+        std::string error;
+        if (!Manifest::Load(manifest_path, &manifest, &error)) {
+            std::cerr << "Could not read manifest " << manifest_path << ": " << error << std::endl;
+            curl_global_cleanup();
+            return 1;
+        }
+        // The manifest's best URL is the source unless one was given; the
+        // rest become mirrors.
+        for (const auto& url : manifest.urls) {
+            if (urls.empty()) {
+                urls.push_back(url);
+            } else if (url != urls[0] && std::find(mirrors.begin(), mirrors.end(), url) == mirrors.end()) {
+                mirrors.push_back(url);
+            }
+        }
+        if (output.empty() && !manifest.name.empty()) {
+            std::string name = std::filesystem::path(manifest.name).filename().string();
+            output = output_dir.empty() ? name : (std::filesystem::path(output_dir) / name).string();
+        }
+        if (expected_hash.empty() && !manifest.hash.empty()) {
+            expected_hash = manifest.hash;
+            hash_type = manifest.hash_type;
+            hash_name = HashName(hash_type);
+        }
+        expected_size = manifest.size;
+        piece_size = manifest.piece_size;
+        piece_hashes = manifest.pieces;
+    }
+
+    DeltaIndex delta;
+    if (!delta_path.empty()) {
+        bool remote = delta_path.rfind("http://", 0) == 0 || delta_path.rfind("https://", 0) == 0;
+        std::vector<char> data;
+        bool read = false;
+        if (remote) {
+            NetworkOptions net_options;
+            net_options.timeout_ms = timeout_ms;
+            net_options.connect_timeout_ms = connect_timeout_ms;
+            net_options.verify_tls = verify_tls;
+            net_options.user_agent = user_agent;
+            net_options.headers = headers;
+            read = NetworkLayer::Fetch(delta_path, net_options, &data);
+        } else {
+            std::ifstream file(delta_path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            read = file.is_open();
+        }
+        std::string error = read ? "" : "cannot read it";
+        if (!read || !DeltaIndex::Load(data, &delta, &error)) {
+            std::cerr << "Could not load delta index " << delta_path << ": " << error << std::endl;
+            curl_global_cleanup();
+            return 1;
+        }
+        if (urls.empty() && !delta.GetUrl().empty()) {
+            urls.push_back(remote ? NetworkLayer::ResolveUrl(delta_path, delta.GetUrl()) : delta.GetUrl());
+        }
+        if (output.empty() && !delta.GetFilename().empty()) {
+            std::string name = std::filesystem::path(delta.GetFilename()).filename().string();
+            output = output_dir.empty() ? name : (std::filesystem::path(output_dir) / name).string();
+        }
+        if (expected_hash.empty() && !delta.GetSha1().empty()) {
+            expected_hash = delta.GetSha1();
+            hash_type = Verifier::HashType::SHA1;
+            hash_name = HashName(hash_type);
+        }
+        if (expected_size > 0 && expected_size != delta.GetLength()) {
+            std::cerr << "Delta index is for " << delta.GetLength() << " bytes, manifest says " << expected_size << std::endl;
+            curl_global_cleanup();
+            return 1;
+        }
+        expected_size = delta.GetLength();
+    }
+
     if (urls.empty()) {
         PrintUsage();
         curl_global_cleanup();
@@ -210,6 +421,51 @@ int main(int argc, char* argv[]) {
         curl_global_cleanup();
         return 1;
     }
+    std::transform(expected_hash.begin(), expected_hash.end(), expected_hash.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+    if ((!manifest_path.empty() || !piece_hashes_path.empty() || !delta_path.empty()) && urls.size() > 1) {
+        std::cerr << "Manifests and delta indexes can only be used with a single URL" << std::endl;
+        curl_global_cleanup();
+        return 1;
+    }
+
+    if (!piece_hashes_path.empty()) {
+        Manifest manifest;
+        std::string error;
+        if (!Manifest::Load(piece_hashes_path, &manifest, &error) || manifest.pieces.empty()) {
+            std::cerr << "Could not read piece hashes from " << piece_hashes_path << (error.empty() ? "" : ": " + error) << std::endl;
+            curl_global_cleanup();
+            return 1;
+        }
+        piece_size = manifest.piece_size;
+        piece_hashes = manifest.pieces;
+    }
+
+    bool to_stdout = output == "-";
+    if ((to_stdout || decompress) && (!piece_hashes.empty() || tree_digest || !delta_path.empty() || mmap_output || io_uring)) {
+        std::cerr << "Piece hashes, tree digests, delta downloads, --mmap and --io-uring need the downloaded file itself, not stdout or --decompress" << std::endl;
+        curl_global_cleanup();
+        return 1;
+    }
+    if (decompress && Decompressor::GetSupportedFormats().empty()) {
+        std::cerr << "Decompression support is not built in (zlib, liblzma or libzstd were not found)" << std::endl;
+        curl_global_cleanup();
+        return 1;
+    }
+    if (to_stdout) UI::ReportToStderr();
+
+    if (mmap_output && io_uring) {
+        std::cerr << "--mmap and --io-uring cannot be combined" << std::endl;
+        curl_global_cleanup();
+        return 1;
+    }
+
+#ifndef FASTGET_HAVE_IO_URING
+    if (io_uring) {
+        std::cerr << "io_uring support is not built in (configure with -DFASTGET_WITH_IO_URING=ON); using pwrite" << std::endl;
+    }
+#endif
 
     if (!output_dir.empty()) {
         std::filesystem::create_directories(output_dir);
@@ -217,8 +473,18 @@ int main(int argc, char* argv[]) {
 
     std::signal(SIGINT, signalHandler);
 
+    NetworkShare share(urls.size() == 1);
+    BufferPool buffers(huge_pages);
+    buffers.SetLimit(max_memory);
+    RateLimiter limiter(max_rate, rate_burst);
+    for (const auto& host_rate : host_rates) {
+        limiter.SetHostRate(host_rate.first, host_rate.second);
+    }
+
     DownloadOptions options;
     options.num_threads = threads;
+    options.max_connections = max_connections;
+    options.max_per_mirror = max_per_mirror;
     options.max_rate = max_rate;
     options.retries = retries;
     options.retry_delay_ms = retry_delay_ms;
@@ -228,30 +494,60 @@ int main(int argc, char* argv[]) {
     options.user_agent = user_agent;
     options.verify_tls = verify_tls;
     options.resume = resume;
+    options.buffered = buffered;
+    options.mmap_output = mmap_output;
+    options.io_uring = io_uring;
+    options.share = &share;
+    options.buffers = &buffers;
+    // Without any rate to enforce, transfers skip the token bucket entirely.
+    options.limiter = max_rate > 0 || !host_rates.empty() ? &limiter : nullptr;
+    options.expected_size = expected_size;
+    options.expected_digest = expected_hash;
+    options.file_digest_type = hash_type;
+    options.tree_digest = tree_digest;
+    options.piece_size = piece_size;
+    options.piece_hashes = piece_hashes;
+    options.delta = delta_path.empty() ? nullptr : &delta;
+    options.seed_path = seed_path;
+    options.fast_start = fast_start;
+    if (reorder_window > 0) options.reorder_window = reorder_window;
+    options.decompress = decompress;
+
+    std::vector<std::string> output_paths = OutputPaths(urls, output, output_dir, decompress);
+    if (urls.size() > 1) {
+        std::vector<BatchJob> jobs;
+        for (size_t i = 0; i < urls.size(); ++i) {
+            jobs.push_back(BatchJob{urls[i], output_paths[i]});
+        }
+        BatchScheduler batch(jobs, mirrors, options, max_per_host);
+        global_batch = &batch;
+        bool success = batch.Run();
+        global_batch = nullptr;
+        curl_global_cleanup();
+        return success ? 0 : 1;
+    }
 
     bool all_success = true;
 
-    for (const auto& url : urls) {
-        std::string output_path = output;
-        if (output_path.empty()) {
-            std::string name = BaseNameFromUrl(url);
-            if (!output_dir.empty()) {
-                output_path = (std::filesystem::path(output_dir) / name).string();
-            } else {
-                output_path = name;
-            }
-        }
+    for (size_t i = 0; i < urls.size(); ++i) {
+        const std::string& url = urls[i];
+        const std::string& output_path = output_paths[i];
 
         Downloader dl(url, mirrors, output_path, options);
         global_downloader = &dl;
 
         bool success = dl.Start();
+        std::ostream& report = to_stdout ? std::cerr : std::cout;
         if (success && !expected_hash.empty()) {
-            std::cout << "Verifying " << hash_name << "..." << std::endl;
-            if (Verifier::Verify(output_path, expected_hash, hash_type)) {
-                std::cout << "Checksum verified: SUCCESS" << std::endl;
+            report << "Verifying " << hash_name << "..." << std::endl;
+            // The digest is normally computed during the download; reading
+            // the file back is only a fallback.
+            std::string digest = dl.GetFileDigest();
+            bool verified = digest.empty() ? Verifier::Verify(output_path, expected_hash, hash_type) : digest == expected_hash;
+            if (verified) {
+                report << "Checksum verified: SUCCESS" << std::endl;
             } else {
-                std::cout << "Checksum verified: FAILED (File might be corrupted)" << std::endl;
+                report << "Checksum verified: FAILED (File might be corrupted)" << std::endl;
                 success = false;
             }
         }
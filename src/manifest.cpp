@@ -0,0 +1,291 @@
+#include "manifest.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace fastget {
+
+namespace {
+
+struct XmlTag {
+    std::string name; // local name, namespace prefix dropped
+    std::map<std::string, std::string> attributes;
+    bool closing = false;
+    bool empty = false; // <tag/>
+};
+
+std::string Trim(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(start, end - start + 1);
+}
+
+std::string Lowercase(std::string text) {
+    for (char& c : text) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return text;
+}
+
+std::string DecodeEntities(const std::string& text) {
+    static const std::pair<const char*, char> kEntities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+    };
+    std::string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size();) {
+        bool decoded = false;
+        if (text[i] == '&') {
+            for (const auto& [entity, c] : kEntities) {
+                size_t length = std::char_traits<char>::length(entity);
+                if (text.compare(i, length, entity) == 0) {
+                    result += c;
+                    i += length;
+                    decoded = true;
+                    break;
+                }
+            }
+        }
+        if (!decoded) result += text[i++];
+    }
+    return result;
+}
+
+std::string LocalName(const std::string& name) {
+    size_t colon = name.find(':');
+    return colon == std::string::npos ? name : name.substr(colon + 1);
+}
+
+// Moves `pos` past the next tag, returning the character data in front of
+// it. Comments, declarations and processing instructions come back as a tag
+// with an empty name.
+bool NextTag(const std::string& xml, size_t& pos, XmlTag* tag, std::string* text) {
+    size_t open = xml.find('<', pos);
+    if (open == std::string::npos) return false;
+    *text = DecodeEntities(xml.substr(pos, open - pos));
+    *tag = XmlTag{};
+
+    if (xml.compare(open, 4, "<!--") == 0) {
+        size_t end = xml.find("-->", open + 4);
+        if (end == std::string::npos) return false;
+        pos = end + 3;
+        return true;
+    }
+
+    size_t close = open + 1;
+    char quote = 0;
+    for (; close < xml.size(); ++close) {
+        char c = xml[close];
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '>') {
+            break;
+        }
+    }
+    if (close >= xml.size()) return false;
+    pos = close + 1;
+
+    std::string body = xml.substr(open + 1, close - open - 1);
+    if (body.empty() || body[0] == '?' || body[0] == '!') return true;
+    if (body[0] == '/') {
+        tag->closing = true;
+        body.erase(0, 1);
+    }
+    if (!body.empty() && body.back() == '/') {
+        tag->empty = true;
+        body.pop_back();
+    }
+
+    size_t i = 0;
+    while (i < body.size() && !std::isspace(static_cast<unsigned char>(body[i]))) ++i;
+    tag->name = LocalName(body.substr(0, i));
+
+    while (i < body.size()) {
+        while (i < body.size() && std::isspace(static_cast<unsigned char>(body[i]))) ++i;
+        size_t eq = body.find('=', i);
+        if (eq == std::string::npos) break;
+        std::string key = LocalName(Trim(body.substr(i, eq - i)));
+        size_t value_start = body.find_first_of("\"'", eq);
+        if (value_start == std::string::npos) break;
+        size_t value_end = body.find(body[value_start], value_start + 1);
+        if (value_end == std::string::npos) break;
+        tag->attributes[key] = DecodeEntities(body.substr(value_start + 1, value_end - value_start - 1));
+        i = value_end + 1;
+    }
+    return true;
+}
+
+int HashStrength(Verifier::HashType type) {
+    switch (type) {
+        case Verifier::HashType::SHA512: return 3;
+        case Verifier::HashType::SHA256: return 2;
+        case Verifier::HashType::SHA1: return 1;
+        case Verifier::HashType::MD5:
+        default: return 0;
+    }
+}
+
+bool ParseSize(const std::string& text, size_t* value) {
+    std::string digits = Trim(text);
+    if (digits.empty() || !std::all_of(digits.begin(), digits.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+        return false;
+    }
+    // Out-of-range values are a malformed manifest, not a reason to abort.
+    auto [end, result] = std::from_chars(digits.data(), digits.data() + digits.size(), *value);
+    return result == std::errc() && end == digits.data() + digits.size();
+}
+
+}
+
+bool Manifest::Load(const std::string& filename, Manifest* manifest, std::string* error) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        *error = "cannot open " + filename;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string text = buffer.str();
+
+    *manifest = Manifest{};
+    size_t first = text.find_first_not_of(" \t\r\n\xEF\xBB\xBF");
+    bool ok = first != std::string::npos && text[first] == '<'
+                  ? ParseMetalink(text, manifest, error)
+                  : ParseText(text, manifest, error);
+    if (!ok) return false;
+
+    if (!manifest->pieces.empty() && manifest->piece_size == 0) {
+        *error = "piece hashes without a piece size";
+        return false;
+    }
+    if (manifest->size > 0 && !manifest->pieces.empty() &&
+        (manifest->size + manifest->piece_size - 1) / manifest->piece_size != manifest->pieces.size()) {
+        *error = "piece hashes do not cover the file size";
+        return false;
+    }
+    return true;
+}
+
+bool Manifest::ParseMetalink(const std::string& text, Manifest* manifest, std::string* error) {
+    std::vector<std::pair<long, std::string>> urls;
+    bool in_file = false;
+    bool in_pieces = false;
+    bool piece_sha256 = false;
+    std::map<std::string, std::string> attributes; // of the element whose text comes next
+
+    size_t pos = 0;
+    XmlTag tag;
+    std::string content;
+    while (NextTag(text, pos, &tag, &content)) {
+        if (tag.name.empty()) continue;
+
+        if (!tag.closing) {
+            if (tag.name == "file") {
+                in_file = true;
+                manifest->name = tag.attributes["name"];
+            } else if (in_file && tag.name == "pieces") {
+                in_pieces = true;
+                piece_sha256 = false;
+                Verifier::HashType type;
+                if (Verifier::ParseHashType(tag.attributes["type"], &type) && type == Verifier::HashType::SHA256 &&
+                    ParseSize(tag.attributes["length"], &manifest->piece_size)) {
+                    piece_sha256 = true;
+                }
+            }
+            attributes = tag.attributes;
+            if (!tag.empty) continue;
+        }
+        if (!in_file) continue;
+
+        std::string value = Trim(content);
+        if (tag.name == "file") {
+            break; // later files are not ours
+        } else if (tag.name == "pieces") {
+            in_pieces = false;
+        } else if (tag.name == "size") {
+            if (!ParseSize(value, &manifest->size)) {
+                *error = "bad <size>";
+                return false;
+            }
+        } else if (tag.name == "hash" && in_pieces) {
+            if (!piece_sha256) continue;
+            PieceHasher::Digest digest;
+            if (!Verifier::FromHex(value, digest.data(), digest.size())) {
+                *error = "bad piece hash";
+                return false;
+            }
+            manifest->pieces.push_back(digest);
+        } else if (tag.name == "hash") {
+            Verifier::HashType type;
+            if (Verifier::ParseHashType(attributes["type"], &type)) manifest->SetHash(type, value);
+        } else if (tag.name == "url") {
+            // Lower priority values are preferred; unranked URLs go last.
+            long priority = 1000000;
+            auto it = attributes.find("priority");
+            if (it != attributes.end()) priority = std::strtol(it->second.c_str(), nullptr, 10);
+            if (!value.empty()) urls.emplace_back(priority, value);
+        }
+    }
+
+    if (!in_file) {
+        *error = "no <file> element";
+        return false;
+    }
+    // Piece hashes of a type we do not check are dropped along with their size.
+    if (manifest->pieces.empty()) manifest->piece_size = 0;
+    std::stable_sort(urls.begin(), urls.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (const auto& url : urls) manifest->urls.push_back(url.second);
+    return true;
+}
+
+bool Manifest::ParseText(const std::string& text, Manifest* manifest, std::string* error) {
+    std::istringstream lines(text);
+    std::string line;
+    size_t number = 0;
+    while (std::getline(lines, line)) {
+        number++;
+        line = Trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        size_t space = line.find_first_of(" \t");
+        std::string key = line.substr(0, space);
+        std::string value = space == std::string::npos ? "" : Trim(line.substr(space));
+        Verifier::HashType type;
+
+        bool ok = true;
+        if (value.empty()) {
+            PieceHasher::Digest digest;
+            ok = Verifier::FromHex(key, digest.data(), digest.size());
+            if (ok) manifest->pieces.push_back(digest);
+        } else if (key == "name") {
+            manifest->name = value;
+        } else if (key == "size") {
+            ok = ParseSize(value, &manifest->size);
+        } else if (key == "url") {
+            manifest->urls.push_back(value);
+        } else if (key == "piece-size") {
+            ok = ParseSize(value, &manifest->piece_size) && manifest->piece_size > 0;
+        } else if (Verifier::ParseHashType(key, &type)) {
+            manifest->SetHash(type, value);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            *error = "cannot parse line " + std::to_string(number);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Manifest::SetHash(Verifier::HashType type, const std::string& hex) {
+    if (!hash.empty() && HashStrength(type) <= HashStrength(hash_type)) return;
+    hash_type = type;
+    hash = Lowercase(hex);
+}
+
+}
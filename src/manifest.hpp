@@ -0,0 +1,36 @@
+#pragma once
+#include "verifier.hpp"
+#include "piece_hasher.hpp"
+#include <string>
+#include <vector>
+
+namespace fastget {
+
+// What a download manifest says about a file: where to get it, how big it
+// is and how to check it. Two formats are read:
+//
+//  - Metalink 4 (RFC 5854) XML. Only the first <file> is used: its <size>,
+//    the strongest whole-file <hash>, <url> elements ordered by priority and
+//    SHA-256 <pieces>.
+//  - A plain text format with one entry per line: `name <file>`,
+//    `size <bytes>`, `url <url>` (repeatable), `<algorithm> <hex>` for the
+//    whole file (e.g. `sha-256 ...`), `piece-size <bytes>` and then one
+//    SHA-256 hex digest per piece. Blank lines and `#` comments are ignored.
+struct Manifest {
+    std::string name;
+    size_t size = 0;
+    std::vector<std::string> urls; // most preferred first
+    Verifier::HashType hash_type = Verifier::HashType::SHA256;
+    std::string hash; // lowercase hex, empty if the manifest has none
+    size_t piece_size = 0;
+    std::vector<PieceHasher::Digest> pieces;
+
+    static bool Load(const std::string& filename, Manifest* manifest, std::string* error);
+
+private:
+    static bool ParseMetalink(const std::string& text, Manifest* manifest, std::string* error);
+    static bool ParseText(const std::string& text, Manifest* manifest, std::string* error);
+    void SetHash(Verifier::HashType type, const std::string& hex);
+};
+
+}
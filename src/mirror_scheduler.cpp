@@ -0,0 +1,96 @@
+#include "mirror_scheduler.hpp"
+#include <algorithm>
+
+namespace fastget {
+
+static constexpr double kSmoothing = 0.3;
+static constexpr int kBreakAfterFailures = 3;
+static constexpr auto kMinCooldown = std::chrono::milliseconds(2000);
+static constexpr auto kMaxCooldown = std::chrono::milliseconds(60000);
+
+MirrorScheduler::MirrorScheduler(size_t count, int per_mirror_limit)
+    : mirrors_(count), per_mirror_limit_(per_mirror_limit) {}
+
+int MirrorScheduler::Pick(size_t bytes, Clock::time_point now, int exclude) const {
+    // A broken circuit only holds while some mirror is still healthy; with
+    // nothing left to fail over to, every mirror is fair game again.
+    bool any_healthy = std::any_of(mirrors_.begin(), mirrors_.end(), [](const Mirror& mirror) { return !mirror.open; });
+
+    // The excluded mirror is only a last resort, once no other can take the
+    // range: all of them tripped, cooling down or at their limit.
+    int best = -1;
+    double best_cost = 0.0;
+    for (int pass = 0; pass < 2 && best < 0; ++pass) {
+        for (size_t i = 0; i < mirrors_.size(); ++i) {
+            if ((static_cast<int>(i) == exclude) != (pass == 1)) continue;
+            const Mirror& mirror = mirrors_[i];
+            if (per_mirror_limit_ > 0 && mirror.active >= per_mirror_limit_) continue;
+            if (any_healthy && !Admits(mirror, now)) continue;
+
+            // Queueing behind its own transfers, a mirror finishes the new
+            // range roughly (active + 1) range-times from now; failures
+            // inflate that.
+            double cost = (mirror.active + 1) * ExpectedSeconds(mirror, bytes);
+            cost /= std::max(0.05, 1.0 - mirror.error_rate);
+            if (best < 0 || cost < best_cost) {
+                best = static_cast<int>(i);
+                best_cost = cost;
+            }
+        }
+    }
+    return best;
+}
+
+void MirrorScheduler::OnResult(size_t index, bool success, size_t bytes, double ttfb_seconds, double seconds, Clock::time_point now) {
+    Mirror& mirror = mirrors_[index];
+    mirror.bytes += bytes;
+    mirror.error_rate += kSmoothing * ((success ? 0.0 : 1.0) - mirror.error_rate);
+
+    if (bytes > 0 && seconds > ttfb_seconds) {
+        double rate = bytes / (seconds - ttfb_seconds);
+        mirror.rate = mirror.rate > 0 ? mirror.rate + kSmoothing * (rate - mirror.rate) : rate;
+    }
+    if (ttfb_seconds > 0) {
+        mirror.ttfb = mirror.ttfb > 0 ? mirror.ttfb + kSmoothing * (ttfb_seconds - mirror.ttfb) : ttfb_seconds;
+    }
+
+    if (success) {
+        mirror.consecutive_failures = 0;
+        mirror.open = false;
+        mirror.cooldown = std::chrono::milliseconds(0);
+        return;
+    }
+
+    mirror.consecutive_failures++;
+    if (mirror.open) {
+        // A failed trial after the cooldown re-breaks with a longer one;
+        // stragglers that were already in flight change nothing.
+        if (now >= mirror.reopen_at) {
+            mirror.cooldown = std::min(kMaxCooldown, mirror.cooldown * 2);
+            mirror.reopen_at = now + mirror.cooldown;
+        }
+    } else if (mirror.consecutive_failures >= kBreakAfterFailures) {
+        mirror.open = true;
+        mirror.cooldown = kMinCooldown;
+        mirror.reopen_at = now + mirror.cooldown;
+    }
+}
+
+bool MirrorScheduler::Admits(const Mirror& mirror, Clock::time_point now) const {
+    if (!mirror.open) return true;
+    // Half-open: one trial transfer once the cooldown has passed.
+    return now >= mirror.reopen_at && mirror.active == 0;
+}
+
+double MirrorScheduler::ExpectedSeconds(const Mirror& mirror, size_t bytes) const {
+    // Unmeasured mirrors are assumed as fast as the best known one so that
+    // they get a chance to prove otherwise.
+    double rate = mirror.rate;
+    if (rate <= 0) {
+        for (const auto& other : mirrors_) rate = std::max(rate, other.rate);
+    }
+    if (rate <= 0) return 1.0 + mirror.ttfb;
+    return mirror.ttfb + bytes / rate;
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace fastget {
+
+// Chooses which mirror serves each range. Every mirror keeps moving averages
+// of per-connection throughput, time to first byte and error rate; a new
+// range goes to the mirror expected to finish it soonest given the transfers
+// it already carries, so connections spread in proportion to bandwidth.
+// Mirrors that keep failing are circuit-broken for a growing cooldown and
+// then readmitted with a single trial transfer. Driven from the transfer
+// loop, so not thread-safe.
+class MirrorScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // `per_mirror_limit` caps concurrent transfers per mirror; 0 means no cap.
+    MirrorScheduler(size_t count, int per_mirror_limit);
+
+    // Returns the mirror for a transfer of `bytes`, or -1 when every candidate
+    // is at its limit. `exclude` is only returned when no other mirror can
+    // take the range, e.g. because all others are circuit-broken.
+    int Pick(size_t bytes, Clock::time_point now, int exclude = -1) const;
+
+    void OnStart(size_t index) { mirrors_[index].active++; }
+    void OnRelease(size_t index) { mirrors_[index].active--; }
+    void OnResult(size_t index, bool success, size_t bytes, double ttfb_seconds, double seconds, Clock::time_point now);
+
+    bool IsBroken(size_t index) const { return mirrors_[index].open; }
+    size_t GetCount() const { return mirrors_.size(); }
+    size_t GetBytes(size_t index) const { return mirrors_[index].bytes; }
+
+private:
+    struct Mirror {
+        int active = 0;
+        double rate = 0.0;       // bytes/s per connection, 0 until measured
+        double ttfb = 0.0;       // seconds
+        double error_rate = 0.0;
+        int consecutive_failures = 0;
+        bool open = false;       // circuit broken
+        std::chrono::milliseconds cooldown{0};
+        Clock::time_point reopen_at;
+        size_t bytes = 0;
+    };
+
+    bool Admits(const Mirror& mirror, Clock::time_point now) const;
+    double ExpectedSeconds(const Mirror& mirror, size_t bytes) const;
+
+    std::vector<Mirror> mirrors_;
+    int per_mirror_limit_;
+};
+
+}
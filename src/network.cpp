@@ -1,7 +1,32 @@
 #include "network.hpp"
+#include <algorithm>
+#include <cctype>
 
 namespace fastget {
 
+NetworkShare::NetworkShare(bool share_connections) {
+    share_ = curl_share_init();
+    if (!share_) return;
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, Lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, Unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if (share_connections) curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+NetworkShare::~NetworkShare() {
+    if (share_) curl_share_cleanup(share_);
+}
+
+void NetworkShare::Lock(CURL*, curl_lock_data data, curl_lock_access, void* userp) {
+    static_cast<NetworkShare*>(userp)->locks_[data].lock();
+}
+
+void NetworkShare::Unlock(CURL*, curl_lock_data data, void* userp) {
+    static_cast<NetworkShare*>(userp)->locks_[data].unlock();
+}
+
 size_t NetworkLayer::WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t totalSize = size * nmemb;
     std::vector<char>* buffer = static_cast<std::vector<char>*>(userp);
@@ -9,6 +34,12 @@ size_t NetworkLayer::WriteCallback(void* contents, size_t size, size_t nmemb, vo
     return totalSize;
 }
 
+// The size is in the headers; a server that ignores the range would
+// otherwise send the whole file.
+static size_t AbortOnBodyCallback(void*, size_t, size_t, void*) {
+    return 0;
+}
+
 static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
     std::string header(buffer, size * nitems);
     size_t pos = header.find("Content-Range:");
@@ -25,7 +56,175 @@ static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* use
     return size * nitems;
 }
 
-static void ApplyNetworkOptions(CURL* curl, const NetworkOptions& options, curl_slist** headers) {
+namespace {
+
+struct PrefixState {
+    CURL* curl;
+    std::vector<char>* body;
+    size_t limit;
+    long range_start = -1;
+    long range_total = -1; // -1 also when the server does not know it
+    long length = -1;
+    long size = -1;        // settled by the first body bytes
+    bool stopped = false;  // dropped on purpose past the headers
+};
+
+}
+
+// Splits a response header line into a lowercase name and a trimmed value.
+static bool SplitHeader(const std::string& line, std::string* name, std::string* value) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return false;
+    *name = line.substr(0, colon);
+    std::transform(name->begin(), name->end(), name->begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    size_t start = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r\n");
+    *value = start == std::string::npos || end < start ? "" : line.substr(start, end - start + 1);
+    return true;
+}
+
+// Reads `bytes <start>-<end>/<total>`; `total` stays -1 for `*`.
+static bool ParseContentRange(const std::string& value, long* start, long* total) {
+    size_t digits = value.find_first_of("0123456789");
+    size_t slash = value.find('/');
+    if (digits == std::string::npos || slash == std::string::npos || digits > slash) return false;
+    try {
+        *start = std::stol(value.substr(digits));
+        if (value.find('*', slash) == std::string::npos) *total = std::stol(value.substr(slash + 1));
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+long NetworkLayer::GetRangeStart(const std::string& header) {
+    std::string name, value;
+    long start = -1;
+    long total = -1;
+    if (!SplitHeader(header, &name, &value) || name != "content-range") return -1;
+    return ParseContentRange(value, &start, &total) ? start : -1;
+}
+
+static size_t PrefixHeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto* state = static_cast<PrefixState*>(userdata);
+    std::string header(buffer, size * nitems);
+    if (header.compare(0, 5, "HTTP/") == 0) {
+        // A new response, e.g. after a redirect.
+        state->range_start = state->range_total = state->length = -1;
+        return size * nitems;
+    }
+    std::string name, value;
+    if (!SplitHeader(header, &name, &value)) return size * nitems;
+
+    if (name == "content-range") {
+        ParseContentRange(value, &state->range_start, &state->range_total);
+    } else if (name == "content-length") {
+        try {
+            state->length = std::stol(value);
+        } catch (...) {}
+    }
+    return size * nitems;
+}
+
+static size_t PrefixWriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto* state = static_cast<PrefixState*>(userp);
+    size_t bytes = size * nmemb;
+    if (state->size < 0) {
+        long code = 0;
+        curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code == 206 && state->range_start == 0) {
+            state->size = state->range_total;
+        } else if (code == 200) {
+            state->size = state->length; // the range was ignored; the body is the whole file
+        }
+        if (state->size <= 0) return 0;
+    }
+
+    char* data = static_cast<char*>(contents);
+    state->body->insert(state->body->end(), data, data + bytes);
+    if (static_cast<size_t>(state->size) > state->limit) {
+        // Too big for one request; the rest goes out in parallel ranges.
+        state->stopped = true;
+        return 0;
+    }
+    return bytes;
+}
+
+namespace {
+
+struct StreamState {
+    CURL* curl;
+    size_t offset;
+    const std::atomic<bool>* running;
+    const std::function<bool(const NetworkLayer::StreamInfo&)>* on_headers;
+    const std::function<bool(const char*, size_t)>* on_data;
+    long range_start = -1;
+    long range_total = -1;
+    long long length = -1;
+    std::string etag{};
+    std::string last_modified{};
+    bool started = false;
+};
+
+}
+
+static size_t StreamHeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto* state = static_cast<StreamState*>(userdata);
+    std::string header(buffer, size * nitems);
+    if (header.compare(0, 5, "HTTP/") == 0) {
+        state->range_start = state->range_total = -1;
+        state->length = -1;
+        state->etag.clear();
+        state->last_modified.clear();
+        return size * nitems;
+    }
+    std::string name, value;
+    if (!SplitHeader(header, &name, &value)) return size * nitems;
+
+    if (name == "content-range") {
+        ParseContentRange(value, &state->range_start, &state->range_total);
+    } else if (name == "content-length") {
+        try {
+            state->length = std::stoll(value);
+        } catch (...) {}
+    } else if (name == "etag") {
+        // Weak validators cannot be used with If-Range.
+        if (value.compare(0, 2, "W/") != 0) state->etag = value;
+    } else if (name == "last-modified") {
+        state->last_modified = value;
+    }
+    return size * nitems;
+}
+
+static bool StartStream(StreamState* state) {
+    state->started = true;
+    long code = 0;
+    curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &code);
+
+    NetworkLayer::StreamInfo info;
+    if (code == 206) {
+        // Only the range we asked for lines up with what is on disk.
+        if (state->range_start != static_cast<long>(state->offset)) return false;
+        info.offset = state->offset;
+    } else if (code != 200) {
+        return false;
+    }
+    info.length = state->length;
+    info.validator = !state->etag.empty() ? state->etag : state->last_modified;
+    return (*state->on_headers)(info);
+}
+
+static size_t StreamWriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto* state = static_cast<StreamState*>(userp);
+    if (!state->started && !StartStream(state)) return 0;
+    return (*state->on_data)(static_cast<const char*>(contents), size * nmemb) ? size * nmemb : 0;
+}
+
+static int StreamProgressCallback(void* userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    return static_cast<StreamState*>(userp)->running->load() ? 0 : 1;
+}
+
+void NetworkLayer::ApplyOptions(CURL* curl, const NetworkOptions& options, curl_slist** headers) {
     if (!options.user_agent.empty()) {
         curl_easy_setopt(curl, CURLOPT_USERAGENT, options.user_agent.c_str());
     } else {
@@ -37,8 +236,8 @@ static void ApplyNetworkOptions(CURL* curl, const NetworkOptions& options, curl_
     if (options.connect_timeout_ms > 0) {
         curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, options.connect_timeout_ms);
     }
-    if (options.max_speed > 0) {
-        curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, static_cast<curl_off_t>(options.max_speed));
+    if (options.share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, options.share);
     }
     if (options.verify_tls) {
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
@@ -55,6 +254,35 @@ static void ApplyNetworkOptions(CURL* curl, const NetworkOptions& options, curl_
     }
 }
 
+std::string NetworkLayer::GetHost(const std::string& url) {
+    std::string host;
+    CURLU* handle = curl_url();
+    if (!handle) return host;
+    char* part = nullptr;
+    if (curl_url_set(handle, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(handle, CURLUPART_HOST, &part, 0) == CURLUE_OK) {
+        host = part;
+        curl_free(part);
+    }
+    curl_url_cleanup(handle);
+    return host;
+}
+
+std::string NetworkLayer::ResolveUrl(const std::string& base, const std::string& reference) {
+    std::string resolved = reference;
+    CURLU* handle = curl_url();
+    if (!handle) return resolved;
+    char* url = nullptr;
+    if (curl_url_set(handle, CURLUPART_URL, base.c_str(), 0) == CURLUE_OK &&
+        curl_url_set(handle, CURLUPART_URL, reference.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(handle, CURLUPART_URL, &url, 0) == CURLUE_OK) {
+        resolved = url;
+        curl_free(url);
+    }
+    curl_url_cleanup(handle);
+    return resolved;
+}
+
 long NetworkLayer::GetFileSize(const std::string& url, const NetworkOptions& options) {
     CURL* curl = curl_easy_init();
     if (!curl) return -1;
@@ -70,12 +298,13 @@ long NetworkLayer::GetFileSize(const std::string& url, const NetworkOptions& opt
             curl_easy_setopt(curl, CURLOPT_RANGE, "0-0");
             curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
             curl_easy_setopt(curl, CURLOPT_HEADERDATA, &fileSize);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, AbortOnBodyCallback);
         }
     };
 
     curl_slist* headers = nullptr;
     setup(true);
-    ApplyNetworkOptions(curl, options, &headers);
+    ApplyOptions(curl, options, &headers);
     if (curl_easy_perform(curl) == CURLE_OK) {
         double cl;
         if (curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl) == CURLE_OK && cl > 0) {
@@ -89,7 +318,7 @@ long NetworkLayer::GetFileSize(const std::string& url, const NetworkOptions& opt
             headers = nullptr;
         }
         setup(false);
-        ApplyNetworkOptions(curl, options, &headers);
+        ApplyOptions(curl, options, &headers);
         curl_easy_perform(curl);
     }
 
@@ -100,42 +329,95 @@ long NetworkLayer::GetFileSize(const std::string& url, const NetworkOptions& opt
     return fileSize;
 }
 
-bool NetworkLayer::DownloadChunk(const std::string& url, size_t start, size_t end, std::vector<char>& buffer, const NetworkOptions& options, std::string* error) {
+long NetworkLayer::FetchPrefix(const std::string& url, const NetworkOptions& options, size_t limit, std::vector<char>* prefix) {
     CURL* curl = curl_easy_init();
-    if (!curl) return false;
+    if (!curl) return -1;
 
-    std::string range = std::to_string(start) + "-" + std::to_string(end);
+    prefix->clear();
+    PrefixState state{curl, prefix, limit};
+    curl_slist* headers = nullptr;
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_RANGE, "0-");
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, PrefixHeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &state);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, PrefixWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+    ApplyOptions(curl, options, &headers);
+    CURLcode result = curl_easy_perform(curl);
+
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+    curl_easy_cleanup(curl);
+
+    if (result != CURLE_OK && !state.stopped) {
+        prefix->clear();
+        return -1;
+    }
+    if (prefix->size() > static_cast<size_t>(state.size)) prefix->resize(static_cast<size_t>(state.size));
+    return state.size;
+}
+
+bool NetworkLayer::StreamGet(const std::string& url, const NetworkOptions& options, size_t offset, const std::string& if_range,
+                             const std::atomic<bool>& running,
+                             const std::function<bool(const StreamInfo&)>& on_headers,
+                             const std::function<bool(const char*, size_t)>& on_data) {
+    CURL* curl = curl_easy_init();
+    if (!curl) return false;
+
+    StreamState state{curl, offset, &running, &on_headers, &on_data};
     curl_slist* headers = nullptr;
-    ApplyNetworkOptions(curl, options, &headers);
-    char error_buffer[CURL_ERROR_SIZE];
-    error_buffer[0] = '\0';
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
-
-    CURLcode res = curl_easy_perform(curl);
-    long response_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-    if (error) {
-        if (res != CURLE_OK && error_buffer[0] != '\0') {
-            *error = error_buffer;
-        } else if (res != CURLE_OK) {
-            *error = curl_easy_strerror(res);
-        } else {
-            error->clear();
-        }
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, StreamHeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &state);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, StreamProgressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &state);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    ApplyOptions(curl, options, &headers);
+    if (offset > 0 && !if_range.empty()) {
+        std::string range = std::to_string(offset) + "-";
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        headers = curl_slist_append(headers, ("If-Range: " + if_range).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    } else {
+        state.offset = 0;
     }
+    CURLcode result = curl_easy_perform(curl);
+    // An empty body never reaches the write callback.
+    bool ok = result == CURLE_OK && (state.started || StartStream(&state));
 
     if (headers) {
         curl_slist_free_all(headers);
     }
     curl_easy_cleanup(curl);
+    return ok;
+}
 
-    return (res == CURLE_OK && (response_code == 200 || response_code == 206));
+bool NetworkLayer::Fetch(const std::string& url, const NetworkOptions& options, std::vector<char>* body) {
+    CURL* curl = curl_easy_init();
+    if (!curl) return false;
+
+    body->clear();
+    curl_slist* headers = nullptr;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, body);
+    ApplyOptions(curl, options, &headers);
+    bool ok = curl_easy_perform(curl) == CURLE_OK;
+
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+    curl_easy_cleanup(curl);
+    return ok;
 }
 
 }
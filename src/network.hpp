@@ -2,24 +2,79 @@
 #include <string>
 #include <vector>
 #include <curl/curl.h>
+#include <mutex>
+#include <atomic>
+#include <functional>
 
 namespace fastget {
 
+// Process-wide CURLSH that lets every handle reuse DNS results, TLS sessions
+// and pooled connections, across workers and across files in batch mode.
+class NetworkShare {
+public:
+    // Downloads running side by side each drive their own transfer loop; a
+    // connection cache shared between those loops would hand a socket from
+    // one loop's event set to another's, so they share only DNS and TLS
+    // sessions.
+    explicit NetworkShare(bool share_connections = true);
+    ~NetworkShare();
+
+    NetworkShare(const NetworkShare&) = delete;
+    NetworkShare& operator=(const NetworkShare&) = delete;
+
+    CURLSH* Handle() const { return share_; }
+
+private:
+    static void Lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp);
+    static void Unlock(CURL* handle, curl_lock_data data, void* userp);
+
+    CURLSH* share_ = nullptr;
+    std::mutex locks_[CURL_LOCK_DATA_LAST];
+};
+
 struct NetworkOptions {
     long timeout_ms = 0;
     long connect_timeout_ms = 0;
-    size_t max_speed = 0;
     bool verify_tls = false;
     std::string user_agent;
     std::vector<std::string> headers;
+    CURLSH* share = nullptr;
 };
 
 class NetworkLayer {
 public:
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp);
+    static void ApplyOptions(CURL* curl, const NetworkOptions& options, curl_slist** headers);
+    static std::string GetHost(const std::string& url);
+    // Resolves `reference` against `base`, e.g. a relative URL in a control file.
+    static std::string ResolveUrl(const std::string& base, const std::string& reference);
+    // First byte of a `Content-Range` response header line; -1 for any
+    // other line or one that does not parse.
+    static long GetRangeStart(const std::string& header);
     
     static long GetFileSize(const std::string& url, const NetworkOptions& options);
-    static bool DownloadChunk(const std::string& url, size_t start, size_t end, std::vector<char>& buffer, const NetworkOptions& options, std::string* error);
+    // Learns the size from an open-ended `Range: bytes=0-` GET instead of a
+    // HEAD, keeping the body in `prefix`. A file of at most `limit` bytes is
+    // read to the end; for a larger one the request is dropped once the
+    // headers are in, and `prefix` holds whatever body arrived with them.
+    static long FetchPrefix(const std::string& url, const NetworkOptions& options, size_t limit, std::vector<char>* prefix);
+    // Downloads a small resource (a control file, an index) into memory.
+    static bool Fetch(const std::string& url, const NetworkOptions& options, std::vector<char>* body);
+
+    struct StreamInfo {
+        size_t offset = 0;      // where the body starts in the file; 0 when a resume was refused
+        long long length = -1;  // body length, -1 if the server did not say
+        std::string validator;  // strong ETag, else Last-Modified; empty if neither
+    };
+    // One GET for the whole entity, or for the part from `offset` on when
+    // `if_range` holds the validator the earlier part was fetched under; a
+    // changed entity comes back whole instead. `on_headers` runs once before
+    // the first body byte and `on_data` for every block after it; either can
+    // return false to abort, as does clearing `running`.
+    static bool StreamGet(const std::string& url, const NetworkOptions& options, size_t offset, const std::string& if_range,
+                          const std::atomic<bool>& running,
+                          const std::function<bool(const StreamInfo&)>& on_headers,
+                          const std::function<bool(const char*, size_t)>& on_data);
 };
 
 }
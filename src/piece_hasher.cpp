@@ -0,0 +1,286 @@
+#include "piece_hasher.hpp"
+#include <openssl/evp.h>
+#include <algorithm>
+
+namespace fastget {
+
+static constexpr size_t kReadBufferSize = 256 * 1024;
+static constexpr unsigned char kNodePrefix = 0x01; // keeps inner nodes distinct from piece digests
+
+PieceHasher::PieceHasher(const std::string& path, size_t total_size, size_t piece_size)
+    : path_(path), total_size_(total_size), piece_size_(piece_size) {
+    if (total_size_ == 0 || piece_size_ == 0) return;
+    size_t count = (total_size_ + piece_size_ - 1) / piece_size_;
+    pieces_.resize(count);
+    digests_.resize(count);
+}
+
+PieceHasher::~PieceHasher() {
+    for (auto& piece : pieces_) FreeContext(piece);
+    EVP_MD_CTX_free(file_ctx_);
+    EVP_MD_CTX_free(file_checkpoint_);
+}
+
+void PieceHasher::EnableFileDigest(Verifier::HashType type) {
+    file_algorithm_ = Verifier::GetAlgorithm(type);
+    RestartFileDigest();
+}
+
+void PieceHasher::RestartFileDigest() {
+    if (!file_algorithm_) return;
+    if (!file_ctx_) file_ctx_ = EVP_MD_CTX_new();
+    if (!file_checkpoint_) file_checkpoint_ = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(file_ctx_, file_algorithm_, nullptr);
+    EVP_MD_CTX_copy_ex(file_checkpoint_, file_ctx_);
+    file_piece_ = 0;
+    file_offset_ = 0;
+    file_digest_.clear();
+}
+
+void PieceHasher::SetDigest(size_t piece, const Digest& digest) {
+    if (piece >= pieces_.size() || pieces_[piece].complete) return;
+    FreeContext(pieces_[piece]);
+    digests_[piece] = digest;
+    pieces_[piece].hashed_all = true;
+}
+
+size_t PieceHasher::GetPieceEnd(size_t piece) const {
+    return std::min((piece + 1) * piece_size_, total_size_) - 1;
+}
+
+bool PieceHasher::GetDigest(size_t piece, Digest* out) const {
+    if (piece >= pieces_.size() || !pieces_[piece].complete) return false;
+    *out = digests_[piece];
+    return true;
+}
+
+void PieceHasher::Update(size_t offset, const char* data, size_t size) {
+    if (size == 0 || offset >= total_size_) return;
+    size = std::min(size, total_size_ - offset);
+    size_t end = offset + size;
+    FeedFile(offset, data, size);
+
+    for (size_t i = offset / piece_size_; i < pieces_.size() && GetPieceStart(i) < end; ++i) {
+        Piece& piece = pieces_[i];
+        if (piece.complete || piece.deferred || piece.hashed_all) continue;
+
+        size_t next = GetPieceStart(i) + piece.hashed;
+        size_t stop = std::min(end, GetPieceEnd(i) + 1);
+        if (offset > next) {
+            // A gap in front of these bytes; the file will have to do.
+            piece.deferred = true;
+            FreeContext(piece);
+            continue;
+        }
+        if (stop <= next) continue; // already hashed, e.g. a hedge's overlap
+
+        if (!piece.ctx) {
+            piece.ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(piece.ctx, EVP_sha256(), nullptr);
+        }
+        EVP_DigestUpdate(piece.ctx, data + (next - offset), stop - next);
+        piece.hashed += stop - next;
+        if (GetPieceStart(i) + piece.hashed == GetPieceEnd(i) + 1) {
+            EVP_DigestFinal_ex(piece.ctx, digests_[i].data(), nullptr);
+            FreeContext(piece);
+            piece.hashed_all = true;
+        }
+    }
+}
+
+void PieceHasher::MarkWritten(size_t start, size_t end, std::vector<size_t>* completed, std::vector<size_t>* failed) {
+    if (pieces_.empty() || start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+
+    size_t merged_start = start;
+    size_t merged_end = end;
+    auto it = written_.upper_bound(merged_start);
+    if (it != written_.begin() && std::prev(it)->second + 1 >= merged_start) --it;
+    while (it != written_.end() && it->first <= merged_end + 1) {
+        merged_start = std::min(merged_start, it->first);
+        merged_end = std::max(merged_end, it->second);
+        it = written_.erase(it);
+    }
+    written_[merged_start] = merged_end;
+
+    for (size_t i = start / piece_size_; i <= end / piece_size_; ++i) {
+        if (pieces_[i].complete) continue;
+        if (GetPieceStart(i) >= merged_start && GetPieceEnd(i) <= merged_end) {
+            CompletePiece(i, completed, failed);
+        }
+    }
+    AdvanceFile();
+}
+
+void PieceHasher::CompletePiece(size_t index, std::vector<size_t>* completed, std::vector<size_t>* failed) {
+    Piece& piece = pieces_[index];
+    if (!piece.hashed_all) {
+        FreeContext(piece);
+        piece.ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(piece.ctx, EVP_sha256(), nullptr);
+        bool read = ReadFile(GetPieceStart(index), GetPieceEnd(index) - GetPieceStart(index) + 1, piece.ctx);
+        EVP_DigestFinal_ex(piece.ctx, digests_[index].data(), nullptr);
+        FreeContext(piece);
+        if (!read) {
+            ResetPiece(index);
+            failed->push_back(index);
+            return;
+        }
+    }
+
+    if (expected_.size() == pieces_.size() && digests_[index] != expected_[index]) {
+        ResetPiece(index);
+        failed->push_back(index);
+        return;
+    }
+    piece.complete = true;
+    completed->push_back(index);
+}
+
+void PieceHasher::ResetPiece(size_t index) {
+    FreeContext(pieces_[index]);
+    pieces_[index] = Piece{};
+
+    size_t start = GetPieceStart(index);
+    size_t end = GetPieceEnd(index);
+    auto it = written_.upper_bound(start);
+    if (it != written_.begin()) --it;
+    while (it != written_.end() && it->first <= end) {
+        size_t range_start = it->first;
+        size_t range_end = it->second;
+        if (range_end < start) {
+            ++it;
+            continue;
+        }
+        it = written_.erase(it);
+        if (range_start < start) written_[range_start] = start - 1;
+        if (range_end > end) it = written_.emplace(end + 1, range_end).first;
+    }
+
+    // Bytes of a bad piece may already be in the file digest.
+    if (file_ctx_ && index == file_piece_) {
+        EVP_MD_CTX_copy_ex(file_ctx_, file_checkpoint_);
+        file_offset_ = start;
+    }
+}
+
+void PieceHasher::FeedFile(size_t offset, const char* data, size_t size) {
+    if (!file_ctx_ || file_piece_ >= pieces_.size()) return;
+    if (offset > file_offset_ || offset + size <= file_offset_) return;
+    // Only up to the end of the piece in progress; the digest moves past it
+    // once the piece is known to be good.
+    size_t stop = std::min(offset + size, GetPieceEnd(file_piece_) + 1);
+    if (stop <= file_offset_) return;
+    EVP_DigestUpdate(file_ctx_, data + (file_offset_ - offset), stop - file_offset_);
+    file_offset_ = stop;
+}
+
+void PieceHasher::AdvanceFile() {
+    if (!file_ctx_) return;
+    while (file_piece_ < pieces_.size() && pieces_[file_piece_].complete && file_offset_ == GetPieceEnd(file_piece_) + 1) {
+        file_piece_++;
+        EVP_MD_CTX_copy_ex(file_checkpoint_, file_ctx_);
+    }
+}
+
+void PieceHasher::CatchUp(size_t max_bytes) {
+    if (!file_ctx_) return;
+    AdvanceFile();
+    while (max_bytes > 0 && file_piece_ < pieces_.size() && pieces_[file_piece_].complete) {
+        size_t size = std::min(GetPieceEnd(file_piece_) + 1 - file_offset_, max_bytes);
+        if (!ReadFile(file_offset_, size, file_ctx_)) {
+            EVP_MD_CTX_copy_ex(file_ctx_, file_checkpoint_);
+            file_offset_ = GetPieceStart(file_piece_);
+            return;
+        }
+        file_offset_ += size;
+        max_bytes -= size;
+        AdvanceFile();
+    }
+}
+
+bool PieceHasher::Finish() {
+    if (pieces_.empty()) return false;
+    for (const auto& piece : pieces_) {
+        if (!piece.complete) return false;
+    }
+
+    if (file_ctx_) {
+        CatchUp(total_size_);
+        if (file_offset_ != total_size_) return false;
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hash_len = 0;
+        EVP_DigestFinal_ex(file_ctx_, hash, &hash_len);
+        file_digest_ = Verifier::ToHex(hash, hash_len);
+        EVP_MD_CTX_free(file_ctx_);
+        file_ctx_ = nullptr;
+    }
+
+    // Pair up digests level by level; an odd one out moves up unchanged.
+    std::vector<Digest> level = digests_;
+    while (level.size() > 1) {
+        std::vector<Digest> parents;
+        parents.reserve((level.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                parents.push_back(level[i]);
+                continue;
+            }
+            unsigned char node[1 + 2 * sizeof(Digest)];
+            node[0] = kNodePrefix;
+            std::copy(level[i].begin(), level[i].end(), node + 1);
+            std::copy(level[i + 1].begin(), level[i + 1].end(), node + 1 + sizeof(Digest));
+            Digest parent;
+            EVP_Digest(node, sizeof(node), parent.data(), nullptr, EVP_sha256(), nullptr);
+            parents.push_back(parent);
+        }
+        level.swap(parents);
+    }
+    tree_digest_ = Verifier::ToHex(level[0].data(), level[0].size());
+    return true;
+}
+
+void PieceHasher::Recheck(std::vector<size_t>* failed) {
+    bool verify = expected_.size() == pieces_.size();
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+        if (!pieces_[i].complete) continue;
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        bool read = ReadFile(GetPieceStart(i), GetPieceEnd(i) - GetPieceStart(i) + 1, ctx);
+        EVP_DigestFinal_ex(ctx, digests_[i].data(), nullptr);
+        EVP_MD_CTX_free(ctx);
+        if (!read || (verify && digests_[i] != expected_[i])) {
+            ResetPiece(i);
+            failed->push_back(i);
+        }
+    }
+    tree_digest_.clear();
+    RestartFileDigest();
+}
+
+bool PieceHasher::ReadFile(size_t offset, size_t size, evp_md_ctx_st* ctx) {
+    if (!file_.is_open()) {
+        file_.open(path_, std::ios::binary);
+        if (!file_.is_open()) return false;
+    }
+    file_.clear();
+    file_.seekg(static_cast<std::streamoff>(offset));
+
+    std::vector<char> buffer(std::min(size, kReadBufferSize));
+    while (size > 0) {
+        size_t want = std::min(size, buffer.size());
+        if (!file_.read(buffer.data(), static_cast<std::streamsize>(want))) return false;
+        EVP_DigestUpdate(ctx, buffer.data(), want);
+        size -= want;
+    }
+    return true;
+}
+
+void PieceHasher::FreeContext(Piece& piece) {
+    if (piece.ctx) {
+        EVP_MD_CTX_free(piece.ctx);
+        piece.ctx = nullptr;
+    }
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "verifier.hpp"
+#include <array>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <cstdint>
+
+struct evp_md_ctx_st;
+struct evp_md_st;
+
+namespace fastget {
+
+// Hashes a download piece by piece as it is written, instead of re-reading
+// the finished file. Each piece has its own SHA-256 that the receive path
+// feeds while the piece's bytes arrive in order; a piece whose bytes arrive
+// out of order (a range split mid-piece, leftovers of an interrupted run) is
+// hashed from the output file once it is complete. Complete pieces are
+// checked against an optional manifest right away and combine into a binary
+// Merkle root. A whole-file digest can be kept as well: it is fed inline
+// while the lowest unfinished piece is being written and catches up from the
+// file behind it otherwise.
+//
+// Not thread-safe; everything runs on the transfer loop thread.
+class PieceHasher {
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    PieceHasher(const std::string& path, size_t total_size, size_t piece_size);
+    ~PieceHasher();
+
+    PieceHasher(const PieceHasher&) = delete;
+    PieceHasher& operator=(const PieceHasher&) = delete;
+
+    void SetExpected(const std::vector<Digest>& digests) { expected_ = digests; }
+    void EnableFileDigest(Verifier::HashType type);
+    // Adopts a digest computed earlier for a piece, e.g. from resume state.
+    void SetDigest(size_t piece, const Digest& digest);
+
+    // Bytes that were just written at `offset`.
+    void Update(size_t offset, const char* data, size_t size);
+    // [start, end] has reached the file. Pieces this completes land in
+    // `completed`, or in `failed` if they do not match the manifest; failed
+    // pieces are forgotten so they can be written again.
+    void MarkWritten(size_t start, size_t end, std::vector<size_t>* completed, std::vector<size_t>* failed);
+    // Feeds the whole-file digest from the file, at most `max_bytes` of it.
+    void CatchUp(size_t max_bytes);
+    // Finishes both digests once every piece is complete.
+    bool Finish();
+    // Hashes every complete piece again from the file, e.g. after the
+    // whole-file digest came out wrong. Pieces that no longer match the
+    // manifest land in `failed` and are forgotten; the whole-file digest
+    // starts over.
+    void Recheck(std::vector<size_t>* failed);
+
+    size_t GetPieceCount() const { return pieces_.size(); }
+    size_t GetPieceSize() const { return piece_size_; }
+    size_t GetPieceStart(size_t piece) const { return piece * piece_size_; }
+    size_t GetPieceEnd(size_t piece) const;
+    bool GetDigest(size_t piece, Digest* out) const;
+    std::string GetFileDigest() const { return file_digest_; }
+    std::string GetTreeDigest() const { return tree_digest_; }
+
+private:
+    struct Piece {
+        evp_md_ctx_st* ctx = nullptr;
+        size_t hashed = 0;     // contiguous bytes from the piece start fed to ctx
+        bool deferred = false; // bytes arrived out of order, hash from the file
+        bool hashed_all = false;
+        bool complete = false; // every byte written and the digest final
+    };
+
+    void CompletePiece(size_t index, std::vector<size_t>* completed, std::vector<size_t>* failed);
+    void ResetPiece(size_t index);
+    void RestartFileDigest();
+    void FeedFile(size_t offset, const char* data, size_t size);
+    void AdvanceFile();
+    bool ReadFile(size_t offset, size_t size, evp_md_ctx_st* ctx);
+    void FreeContext(Piece& piece);
+
+    std::string path_;
+    std::ifstream file_;
+    size_t total_size_;
+    size_t piece_size_;
+    std::vector<Piece> pieces_;
+    std::vector<Digest> digests_;
+    std::vector<Digest> expected_;
+    std::map<size_t, size_t> written_; // merged [start, end] ranges on disk
+
+    const evp_md_st* file_algorithm_ = nullptr;
+    evp_md_ctx_st* file_ctx_ = nullptr;
+    evp_md_ctx_st* file_checkpoint_ = nullptr; // file_ctx_ as of the start of file_piece_
+    size_t file_piece_ = 0;  // lowest piece not yet verified into the file digest
+    size_t file_offset_ = 0; // bytes fed to file_ctx_
+    std::string file_digest_;
+    std::string tree_digest_;
+};
+
+}
@@ -0,0 +1,136 @@
+#include "pipe_writer.hpp"
+#include "decompressor.hpp"
+#include "verifier.hpp"
+#include <openssl/evp.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace fastget {
+
+PipeWriter::PipeWriter(int fd, BufferPool* buffers) : FileWriter("-"), fd_out_(fd), buffers_(buffers) {}
+
+PipeWriter::PipeWriter(std::unique_ptr<Decompressor> stage, BufferPool* buffers)
+    : FileWriter("-"), stage_(std::move(stage)), buffers_(buffers) {}
+
+PipeWriter::~PipeWriter() {
+    Release(held_bytes_);
+    EVP_MD_CTX_free(digest_);
+}
+
+bool PipeWriter::Open() {
+    if (stage_) return stage_->Start();
+#ifdef _WIN32
+    // Text mode would turn every \n into \r\n.
+    _setmode(fd_out_, _O_BINARY);
+#endif
+    return true;
+}
+
+bool PipeWriter::WriteAt(size_t offset, const char* data, size_t size) {
+    if (failed_) return false;
+    if (offset < written_) {
+        size_t sent = std::min(size, written_ - offset);
+        offset += sent;
+        data += sent;
+        size -= sent;
+    }
+    if (size == 0) return true;
+
+    if (offset > written_) {
+        std::vector<char>& held = held_[offset];
+        if (held.size() >= size) return true; // a copy is already waiting
+        Hold(size - held.size());
+        held.assign(data, data + size);
+        return true;
+    }
+
+    if (!Emit(data, size)) return false;
+    // Send whatever the new bytes have caught up with.
+    while (!held_.empty() && held_.begin()->first <= written_) {
+        auto node = held_.extract(held_.begin());
+        const std::vector<char>& span = node.mapped();
+        Release(span.size());
+        size_t end = node.key() + span.size();
+        if (end > written_ && !Emit(span.data() + (written_ - node.key()), end - written_)) return false;
+    }
+    return true;
+}
+
+void PipeWriter::Hold(size_t bytes) {
+    held_bytes_ += bytes;
+    peak_held_ = std::max(peak_held_, held_bytes_);
+    if (buffers_) buffers_->Charge(bytes);
+}
+
+void PipeWriter::Release(size_t bytes) {
+    held_bytes_ -= bytes;
+    if (buffers_) buffers_->Discharge(bytes);
+}
+
+bool PipeWriter::Finish() {
+    if (stage_ && !stage_->Finish()) failed_ = true;
+    return !failed_;
+}
+
+std::string PipeWriter::GetError() const {
+    std::string error = stage_ ? stage_->GetError() : "";
+    if (!error.empty()) return error;
+    return failed_ ? "Could not write to the output." : "";
+}
+
+bool PipeWriter::Truncate(size_t size) {
+    return size == written_ && held_.empty();
+}
+
+void PipeWriter::EnableDigest(const evp_md_st* algorithm) {
+    if (!digest_) digest_ = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(digest_, algorithm, nullptr);
+}
+
+std::string PipeWriter::GetDigest() const {
+    if (!digest_) return "";
+    EVP_MD_CTX* copy = EVP_MD_CTX_new();
+    EVP_MD_CTX_copy_ex(copy, digest_);
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = 0;
+    EVP_DigestFinal_ex(copy, hash, &hash_len);
+    EVP_MD_CTX_free(copy);
+    return Verifier::ToHex(hash, hash_len);
+}
+
+bool PipeWriter::Emit(const char* data, size_t size) {
+    if (digest_) EVP_DigestUpdate(digest_, data, size);
+    written_ += size;
+    if (stage_) {
+        if (!stage_->Push(data, size)) failed_ = true;
+        return !failed_;
+    }
+    while (size > 0) {
+#ifdef _WIN32
+        int sent = _write(fd_out_, data, static_cast<unsigned int>(std::min<size_t>(size, 1u << 30)));
+        if (sent < 0) {
+            failed_ = true;
+            return false;
+        }
+#else
+        ssize_t sent = ::write(fd_out_, data, size);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            failed_ = true;
+            return false;
+        }
+#endif
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+}
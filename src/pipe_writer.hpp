@@ -0,0 +1,69 @@
+#pragma once
+#include "file_writer.hpp"
+#include "buffer_pool.hpp"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct evp_md_st;
+struct evp_md_ctx_st;
+
+namespace fastget {
+
+class Decompressor;
+
+// Sends the download to a pipe, e.g. stdout, in file order. A span that
+// arrives ahead of the next byte due waits in memory until the gap in front
+// of it is filled; the chunk manager's dispatch window is what keeps that
+// backlog bounded. Bytes already sent are dropped, so hedged copies and
+// repeated ranges do no harm. Instead of a descriptor the bytes can go to a
+// decompression stage. Held spans are charged to `buffers`, so they count
+// against the same memory limit as the transfer buffers.
+class PipeWriter : public FileWriter {
+public:
+    explicit PipeWriter(int fd, BufferPool* buffers = nullptr);
+    explicit PipeWriter(std::unique_ptr<Decompressor> stage, BufferPool* buffers = nullptr);
+    ~PipeWriter() override;
+
+    using FileWriter::WriteAt;
+
+    bool Open() override;
+    void PreAllocate(size_t) override {}
+    bool WriteAt(size_t offset, const char* data, size_t size) override;
+    bool Sync() override { return !failed_; }
+    void Close() override {}
+    // Sent bytes cannot be taken back, so only a cut at the current end works.
+    bool Truncate(size_t size) override;
+
+    // Digests the bytes in the order they go out.
+    void EnableDigest(const evp_md_st* algorithm);
+    // Lowercase hex of everything sent so far; empty unless enabled.
+    std::string GetDigest() const;
+
+    // Ends the output. With a stage, waits for it to drain; false if it
+    // failed, see GetError().
+    bool Finish();
+    std::string GetError() const;
+    const Decompressor* GetStage() const { return stage_.get(); }
+
+    size_t GetWritten() const { return written_; }
+    size_t GetPeakHeld() const { return peak_held_; }
+
+private:
+    bool Emit(const char* data, size_t size);
+    void Hold(size_t bytes);
+    void Release(size_t bytes);
+
+    int fd_out_ = -1;
+    std::unique_ptr<Decompressor> stage_;
+    BufferPool* buffers_;
+    size_t written_ = 0;
+    std::map<size_t, std::vector<char>> held_; // spans past the next byte due, by offset
+    size_t held_bytes_ = 0;
+    size_t peak_held_ = 0;
+    evp_md_ctx_st* digest_ = nullptr;
+    bool failed_ = false;
+};
+
+}
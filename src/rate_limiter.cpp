@@ -0,0 +1,82 @@
+#include "rate_limiter.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace fastget {
+
+static constexpr size_t kMinBurst = 16 * 1024;
+
+RateLimiter::RateLimiter(size_t bytes_per_second, size_t burst) {
+    global_.Configure(bytes_per_second, burst);
+}
+
+void RateLimiter::SetRate(size_t bytes_per_second, size_t burst) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    global_.Refill(Clock::now());
+    global_.Configure(bytes_per_second, burst);
+}
+
+void RateLimiter::SetHostRate(const std::string& host, size_t bytes_per_second, size_t burst) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Bucket& bucket = hosts_[host];
+    bucket.Refill(Clock::now());
+    bucket.Configure(bytes_per_second, burst);
+}
+
+size_t RateLimiter::GetRate() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<size_t>(global_.rate);
+}
+
+bool RateLimiter::TryAcquire(const std::string& host, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = Clock::now();
+    Bucket* host_bucket = FindHost(host);
+
+    global_.Refill(now);
+    if (host_bucket) host_bucket->Refill(now);
+    if (global_.Wait() > 0 || (host_bucket && host_bucket->Wait() > 0)) return false;
+
+    if (global_.rate > 0) global_.tokens -= bytes;
+    if (host_bucket && host_bucket->rate > 0) host_bucket->tokens -= bytes;
+    return true;
+}
+
+std::chrono::milliseconds RateLimiter::GetWait(const std::string& host) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = Clock::now();
+    Bucket* host_bucket = FindHost(host);
+
+    global_.Refill(now);
+    double wait = global_.Wait();
+    if (host_bucket) {
+        host_bucket->Refill(now);
+        wait = std::max(wait, host_bucket->Wait());
+    }
+    return std::chrono::milliseconds(static_cast<long long>(std::ceil(wait * 1000.0)));
+}
+
+RateLimiter::Bucket* RateLimiter::FindHost(const std::string& host) {
+    if (hosts_.empty()) return nullptr;
+    auto it = hosts_.find(host);
+    return it != hosts_.end() ? &it->second : nullptr;
+}
+
+void RateLimiter::Bucket::Configure(size_t bytes_per_second, size_t burst_bytes) {
+    rate = static_cast<double>(bytes_per_second);
+    burst = burst_bytes > 0 ? static_cast<double>(burst_bytes) : std::max(rate / 10.0, static_cast<double>(kMinBurst));
+    tokens = std::min(tokens, burst);
+}
+
+void RateLimiter::Bucket::Refill(Clock::time_point now) {
+    std::chrono::duration<double> elapsed = now - updated;
+    updated = now;
+    if (rate > 0) tokens = std::min(burst, tokens + elapsed.count() * rate);
+}
+
+double RateLimiter::Bucket::Wait() const {
+    if (rate <= 0 || tokens >= 0) return 0.0;
+    return -tokens / rate;
+}
+
+}
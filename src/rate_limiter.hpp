@@ -0,0 +1,53 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fastget {
+
+// Process-wide token bucket that every transfer draws from, so an aggregate
+// cap holds across connections and across files in batch mode, and any idle
+// connection's share is picked up by the busy ones. Optional per-host buckets
+// are drawn from on top of the global one. Rates may change at any time.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A rate of 0 means unlimited. The burst defaults to a tenth of a
+    // second's worth of the rate.
+    explicit RateLimiter(size_t bytes_per_second = 0, size_t burst = 0);
+
+    void SetRate(size_t bytes_per_second, size_t burst = 0);
+    void SetHostRate(const std::string& host, size_t bytes_per_second, size_t burst = 0);
+    size_t GetRate() const;
+
+    // Charges `bytes` against the global and host buckets. Fails without
+    // charging while either is in debt; a large delivery may overdraw them,
+    // which later callers then wait out.
+    bool TryAcquire(const std::string& host, size_t bytes);
+
+    // Time until TryAcquire for `host` can succeed again.
+    std::chrono::milliseconds GetWait(const std::string& host);
+
+private:
+    struct Bucket {
+        double rate = 0.0; // bytes per second, 0 = unlimited
+        double burst = 0.0;
+        double tokens = 0.0;
+        Clock::time_point updated = Clock::now();
+
+        void Configure(size_t bytes_per_second, size_t burst_bytes);
+        void Refill(Clock::time_point now);
+        double Wait() const;
+    };
+
+    Bucket* FindHost(const std::string& host);
+
+    mutable std::mutex mutex_;
+    Bucket global_;
+    std::unordered_map<std::string, Bucket> hosts_;
+};
+
+}
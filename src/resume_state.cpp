@@ -1,58 +1,171 @@
 #include "resume_state.hpp"
-#include <fstream>
 #include <filesystem>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace fastget {
 
-static constexpr char kMagic[] = "FASTGET1";
+static constexpr char kMagicV1[] = "FASTGET1";
+static constexpr char kMagic[] = "FASTGET2";
 static constexpr size_t kMagicSize = 8;
+static constexpr uint64_t kRecordSeal = 0x46474a524e4c0a01ULL;
+static constexpr uint64_t kDigestRecord = UINT64_MAX; // `end` of a record followed by a block digest
+static constexpr size_t kMinJournalBytes = 64 * 1024;
+static constexpr auto kSaveInterval = std::chrono::milliseconds(250); // the output sync behind it runs off the loop thread
+
+struct JournalRecord {
+    uint64_t start;
+    uint64_t end;
+    uint64_t check; // catches records torn by a crash mid-append
+};
+
+static uint64_t RecordCheck(uint64_t start, uint64_t end) {
+    return start ^ (end * 0x9e3779b97f4a7c15ULL) ^ kRecordSeal;
+}
+
+static uint64_t DigestCheck(uint64_t block, const ResumeState::Digest& digest) {
+    uint64_t check = RecordCheck(block, kDigestRecord);
+    for (size_t i = 0; i < digest.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, digest.data() + i, sizeof(word));
+        check ^= word * (i + 1);
+    }
+    return check;
+}
+
+static void AppendRecord(std::vector<uint8_t>& out, uint64_t start, uint64_t end, uint64_t check) {
+    JournalRecord record{start, end, check};
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+    out.insert(out.end(), bytes, bytes + sizeof(record));
+}
+
+static void AppendDigestRecord(std::vector<uint8_t>& out, size_t block, const ResumeState::Digest& digest) {
+    AppendRecord(out, block, kDigestRecord, DigestCheck(block, digest));
+    out.insert(out.end(), digest.begin(), digest.end());
+}
+
+static bool SyncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) return false;
+#if defined(_WIN32)
+    return _commit(_fileno(file)) == 0;
+#elif defined(__linux__)
+    return fdatasync(fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
 
 ResumeState::ResumeState(const std::string& path) : path_(path) {}
 
+ResumeState::~ResumeState() {
+    CloseJournal();
+}
+
 bool ResumeState::Load(size_t expected_total_size, size_t* out_chunk_size, size_t* out_chunk_count) {
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
     std::lock_guard<std::mutex> lock(mutex_);
     if (!std::filesystem::exists(path_)) return false;
-    std::ifstream file(path_, std::ios::binary);
-    if (!file.is_open()) return false;
+    std::FILE* file = std::fopen(path_.c_str(), "rb");
+    if (!file) return false;
 
     char magic[kMagicSize];
-    file.read(magic, sizeof(magic));
-    if (!file || std::string(magic, sizeof(magic)) != std::string(kMagic, sizeof(magic))) return false;
-
-    uint64_t total_size = 0;
-    uint64_t chunk_size = 0;
-    uint64_t chunk_count = 0;
-    file.read(reinterpret_cast<char*>(&total_size), sizeof(total_size));
-    file.read(reinterpret_cast<char*>(&chunk_size), sizeof(chunk_size));
-    file.read(reinterpret_cast<char*>(&chunk_count), sizeof(chunk_count));
-    if (!file) return false;
-    if (total_size != expected_total_size) return false;
+    uint64_t header[3] = {};
+    bool ok = std::fread(magic, 1, kMagicSize, file) == kMagicSize &&
+              std::fread(header, sizeof(uint64_t), 3, file) == 3;
+    bool packed = ok && std::memcmp(magic, kMagic, kMagicSize) == 0;
+    ok = ok && (packed || std::memcmp(magic, kMagicV1, kMagicSize) == 0);
+    ok = ok && header[0] == expected_total_size;
 
-    std::vector<uint8_t> completed(chunk_count, 0);
-    file.read(reinterpret_cast<char*>(completed.data()), completed.size());
-    if (!file) return false;
+    if (ok) {
+        CloseJournal();
+        total_size_ = static_cast<size_t>(header[0]);
+        chunk_size_ = static_cast<size_t>(header[1]);
+        chunk_count_ = static_cast<size_t>(header[2]);
+        ok = LoadSnapshot(file, packed);
+    }
+    std::fclose(file);
+    if (!ok) return false;
 
-    total_size_ = static_cast<size_t>(total_size);
-    chunk_size_ = static_cast<size_t>(chunk_size);
-    chunk_count_ = static_cast<size_t>(chunk_count);
-    completed_ = std::move(completed);
     initialized_ = true;
-    dirty_ = false;
     last_save_ = std::chrono::steady_clock::now();
-
     if (out_chunk_size) *out_chunk_size = chunk_size_;
     if (out_chunk_count) *out_chunk_count = chunk_count_;
     return true;
 }
 
+bool ResumeState::LoadSnapshot(std::FILE* file, bool packed) {
+    completed_.assign(chunk_count_, 0);
+    partial_.clear();
+    digests_.clear();
+    unsaved_.clear();
+    unsaved_digests_.clear();
+    journal_records_ = 0;
+
+    if (!packed) {
+        // FASTGET1: a byte per block and no journal; the next save converts it.
+        if (std::fread(completed_.data(), 1, completed_.size(), file) != completed_.size()) return false;
+        snapshot_due_ = true;
+        return true;
+    }
+
+    std::vector<uint8_t> bits((chunk_count_ + 7) / 8, 0);
+    if (std::fread(bits.data(), 1, bits.size(), file) != bits.size()) return false;
+    for (size_t i = 0; i < chunk_count_; ++i) {
+        completed_[i] = (bits[i / 8] >> (i % 8)) & 1;
+    }
+
+    // Replay the journal up to the first record that did not make it to disk
+    // whole. Appending after such a tail would hide later records, so a
+    // damaged journal is folded into a fresh snapshot on the next save.
+    JournalRecord record;
+    snapshot_due_ = false;
+    while (true) {
+        size_t read = std::fread(&record, 1, sizeof(record), file);
+        if (read == 0) break;
+        if (read != sizeof(record)) {
+            snapshot_due_ = true;
+            break;
+        }
+        if (record.end == kDigestRecord) {
+            Digest digest;
+            if (std::fread(digest.data(), 1, digest.size(), file) != digest.size() || record.check != DigestCheck(record.start, digest)) {
+                snapshot_due_ = true;
+                break;
+            }
+            if (record.start < chunk_count_) digests_[static_cast<size_t>(record.start)] = digest;
+            continue;
+        }
+        if (record.check != RecordCheck(record.start, record.end)) {
+            snapshot_due_ = true;
+            break;
+        }
+        ApplyRange(static_cast<size_t>(record.start), static_cast<size_t>(record.end));
+        journal_records_++;
+    }
+    return true;
+}
+
 void ResumeState::Initialize(size_t total_size, size_t chunk_size, size_t chunk_count) {
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
     std::lock_guard<std::mutex> lock(mutex_);
+    CloseJournal();
     total_size_ = total_size;
     chunk_size_ = chunk_size;
     chunk_count_ = chunk_count;
     completed_.assign(chunk_count_, 0);
+    partial_.clear();
+    digests_.clear();
+    unsaved_.clear();
+    unsaved_digests_.clear();
+    journal_records_ = 0;
     initialized_ = true;
-    dirty_ = true;
+    snapshot_due_ = true;
     last_save_ = std::chrono::steady_clock::now();
 }
 
@@ -69,10 +182,97 @@ bool ResumeState::IsChunkComplete(size_t chunk_id) const {
 
 void ResumeState::MarkCompleted(size_t chunk_id) {
     std::lock_guard<std::mutex> lock(mutex_);
-    if (!initialized_ || chunk_id >= completed_.size()) return;
-    if (completed_[chunk_id] == 0) {
-        completed_[chunk_id] = 1;
-        dirty_ = true;
+    if (!initialized_ || chunk_id >= completed_.size() || completed_[chunk_id] != 0) return;
+    completed_[chunk_id] = 1;
+    size_t start = chunk_id * chunk_size_;
+    unsaved_.emplace_back(start, std::min(start + chunk_size_, total_size_) - 1);
+}
+
+void ResumeState::MarkRangeCompleted(size_t start, size_t end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!initialized_ || chunk_size_ == 0 || start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+    ApplyRange(start, end);
+    unsaved_.emplace_back(start, end);
+}
+
+void ResumeState::ApplyRange(size_t start, size_t end) {
+    if (chunk_size_ == 0 || start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+
+    // Merge into the partial ranges, absorbing anything it overlaps or touches.
+    auto it = partial_.upper_bound(start);
+    if (it != partial_.begin() && std::prev(it)->second + 1 >= start) --it;
+    while (it != partial_.end() && it->first <= end + 1) {
+        start = std::min(start, it->first);
+        end = std::max(end, it->second);
+        it = partial_.erase(it);
+    }
+    partial_[start] = end;
+
+    // Blocks the merged range now covers entirely move over to the bitmap,
+    // and nothing is kept for edge blocks that were already complete.
+    size_t first = (start + chunk_size_ - 1) / chunk_size_;
+    size_t last = end + 1 >= total_size_ ? completed_.size() : (end + 1) / chunk_size_;
+    for (size_t i = first; i < last && i < completed_.size(); ++i) completed_[i] = 1;
+    if (first < last) ErasePartial(first * chunk_size_, std::min(last * chunk_size_, total_size_) - 1);
+    for (size_t i : {start / chunk_size_, end / chunk_size_}) {
+        if (i < completed_.size() && completed_[i] != 0) {
+            ErasePartial(i * chunk_size_, std::min((i + 1) * chunk_size_, total_size_) - 1);
+        }
+    }
+}
+
+void ResumeState::ClearRange(size_t start, size_t end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!initialized_ || chunk_size_ == 0 || start > end || start >= total_size_) return;
+    end = std::min(end, total_size_ - 1);
+
+    // Whatever a finished block keeps outside the range stays as partial.
+    std::vector<std::pair<size_t, size_t>> kept;
+    for (size_t i = start / chunk_size_; i <= end / chunk_size_ && i < completed_.size(); ++i) {
+        digests_.erase(i);
+        if (completed_[i] == 0) continue;
+        completed_[i] = 0;
+        size_t block_start = i * chunk_size_;
+        size_t block_end = std::min(block_start + chunk_size_, total_size_) - 1;
+        if (block_start < start) kept.emplace_back(block_start, start - 1);
+        if (block_end > end) kept.emplace_back(end + 1, block_end);
+    }
+    ErasePartial(start, end);
+    for (const auto& [kept_start, kept_end] : kept) ApplyRange(kept_start, kept_end);
+
+    // The journal can only add, so the next save has to rewrite the file.
+    snapshot_due_ = true;
+}
+
+void ResumeState::SetBlockDigest(size_t block, const Digest& digest) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!initialized_ || block >= completed_.size()) return;
+    auto it = digests_.find(block);
+    if (it != digests_.end() && it->second == digest) return;
+    digests_[block] = digest;
+    unsaved_digests_.push_back(block);
+}
+
+std::map<size_t, ResumeState::Digest> ResumeState::GetBlockDigests() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return digests_;
+}
+
+void ResumeState::ErasePartial(size_t start, size_t end) {
+    auto it = partial_.upper_bound(start);
+    if (it != partial_.begin()) --it;
+    while (it != partial_.end() && it->first <= end) {
+        size_t range_start = it->first;
+        size_t range_end = it->second;
+        if (range_end < start) {
+            ++it;
+            continue;
+        }
+        it = partial_.erase(it);
+        if (range_start < start) partial_[range_start] = start - 1;
+        if (range_end > end) it = partial_.emplace(end + 1, range_end).first;
     }
 }
 
@@ -87,40 +287,165 @@ std::vector<size_t> ResumeState::GetCompletedChunks() const {
     return result;
 }
 
+std::vector<std::pair<size_t, size_t>> ResumeState::GetCompletedRanges() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<size_t, size_t>> result;
+    if (!initialized_ || chunk_size_ == 0) return result;
+
+    // Whole blocks and partial ranges never overlap, so walking both in
+    // order and joining neighbours gives the coalesced list.
+    auto append = [&result](size_t start, size_t end) {
+        if (!result.empty() && result.back().second + 1 == start) {
+            result.back().second = end;
+        } else {
+            result.emplace_back(start, end);
+        }
+    };
+    auto partial = partial_.begin();
+    for (size_t i = 0; i < completed_.size(); ++i) {
+        if (completed_[i] == 0) continue;
+        size_t start = i * chunk_size_;
+        for (; partial != partial_.end() && partial->first < start; ++partial) append(partial->first, partial->second);
+        append(start, std::min(start + chunk_size_, total_size_) - 1);
+    }
+    for (; partial != partial_.end(); ++partial) append(partial->first, partial->second);
+    return result;
+}
+
 void ResumeState::Save() {
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
+    bool snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!initialized_) return;
+
+        // Once the journal outgrows the bitset, replaying it costs more than
+        // a snapshot would.
+        size_t journal_bytes = (journal_records_ + unsaved_.size()) * sizeof(JournalRecord);
+        size_t snapshot_bytes = (chunk_count_ + 7) / 8;
+        snapshot = snapshot_due_ || journal_bytes > std::max(snapshot_bytes, kMinJournalBytes);
+        if (!snapshot && unsaved_.empty() && unsaved_digests_.empty()) {
+            last_save_ = std::chrono::steady_clock::now();
+            return;
+        }
+    }
+    if (snapshot || !AppendJournal()) WriteSnapshot();
+}
+
+void ResumeState::Compact() {
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
+    WriteSnapshot();
+}
+
+bool ResumeState::IsSaveDue(bool pending) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!initialized_) return false;
+    if (!pending && unsaved_.empty() && unsaved_digests_.empty() && !snapshot_due_) return false;
+    return std::chrono::steady_clock::now() - last_save_ >= kSaveInterval;
+}
+
+bool ResumeState::AppendJournal() {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<size_t> blocks;
+    std::vector<uint8_t> records;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (snapshot_due_) return false; // a range was cleared meanwhile
+        ranges.swap(unsaved_);
+        blocks.swap(unsaved_digests_);
+        for (const auto& [start, end] : ranges) {
+            AppendRecord(records, start, end, RecordCheck(start, end));
+        }
+        for (size_t block : blocks) {
+            auto it = digests_.find(block);
+            if (it != digests_.end()) AppendDigestRecord(records, block, it->second);
+        }
+    }
+
+    if (!journal_ && std::filesystem::exists(path_)) journal_ = std::fopen(path_.c_str(), "ab");
+    bool ok = journal_ &&
+              std::fwrite(records.data(), 1, records.size(), journal_) == records.size() &&
+              SyncFile(journal_);
+
     std::lock_guard<std::mutex> lock(mutex_);
-    SaveLocked();
+    if (!ok) {
+        // The tail may now be torn; only a fresh snapshot is trustworthy,
+        // so nothing more is appended until one is written.
+        CloseJournal();
+        snapshot_due_ = true;
+        unsaved_.insert(unsaved_.begin(), ranges.begin(), ranges.end());
+        unsaved_digests_.insert(unsaved_digests_.begin(), blocks.begin(), blocks.end());
+        return false;
+    }
+    journal_records_ += ranges.size();
+    last_save_ = std::chrono::steady_clock::now();
+    return true;
 }
 
-void ResumeState::MaybeSave() {
+void ResumeState::WriteSnapshot() {
+    std::vector<uint8_t> bits;
+    std::vector<uint8_t> records;
+    uint64_t header[3] = {};
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<size_t> blocks;
+    size_t partial_records = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!initialized_) return;
+        bits.assign((chunk_count_ + 7) / 8, 0);
+        for (size_t i = 0; i < completed_.size(); ++i) {
+            if (completed_[i] != 0) bits[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+        }
+        // Partly finished blocks and block digests carry over as the new
+        // journal's first records.
+        for (const auto& [start, end] : partial_) {
+            AppendRecord(records, start, end, RecordCheck(start, end));
+        }
+        for (const auto& [block, digest] : digests_) {
+            AppendDigestRecord(records, block, digest);
+        }
+        header[0] = total_size_;
+        header[1] = chunk_size_;
+        header[2] = chunk_count_;
+        partial_records = partial_.size();
+        // Anything cleared from here on sets it again.
+        ranges.swap(unsaved_);
+        blocks.swap(unsaved_digests_);
+        snapshot_due_ = false;
+    }
+
+    std::string temp_path = path_ + ".tmp";
+    std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+    bool ok = file &&
+              std::fwrite(kMagic, 1, kMagicSize, file) == kMagicSize &&
+              std::fwrite(header, sizeof(uint64_t), 3, file) == 3 &&
+              std::fwrite(bits.data(), 1, bits.size(), file) == bits.size() &&
+              std::fwrite(records.data(), 1, records.size(), file) == records.size() &&
+              SyncFile(file);
+    if (file) std::fclose(file);
+    if (ok) {
+        CloseJournal();
+        std::error_code error;
+        std::filesystem::rename(temp_path, path_, error);
+        ok = !error;
+    }
+
     std::lock_guard<std::mutex> lock(mutex_);
-    if (!dirty_) return;
-    auto now = std::chrono::steady_clock::now();
-    if (now - last_save_ < std::chrono::seconds(1)) return;
-    SaveLocked();
-}
-
-void ResumeState::SaveLocked() {
-    if (!initialized_) return;
-    std::filesystem::path temp_path = path_ + ".tmp";
-    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
-    if (!file.is_open()) return;
-
-    file.write(kMagic, kMagicSize);
-    uint64_t total_size = total_size_;
-    uint64_t chunk_size = chunk_size_;
-    uint64_t chunk_count = chunk_count_;
-    file.write(reinterpret_cast<const char*>(&total_size), sizeof(total_size));
-    file.write(reinterpret_cast<const char*>(&chunk_size), sizeof(chunk_size));
-    file.write(reinterpret_cast<const char*>(&chunk_count), sizeof(chunk_count));
-    if (!completed_.empty()) {
-        file.write(reinterpret_cast<const char*>(completed_.data()), completed_.size());
-    }
-    file.flush();
-    file.close();
-    std::filesystem::rename(temp_path, path_);
-    dirty_ = false;
+    if (!ok) {
+        snapshot_due_ = true;
+        unsaved_.insert(unsaved_.begin(), ranges.begin(), ranges.end());
+        unsaved_digests_.insert(unsaved_digests_.begin(), blocks.begin(), blocks.end());
+        return;
+    }
+    journal_records_ = partial_records;
     last_save_ = std::chrono::steady_clock::now();
 }
 
+void ResumeState::CloseJournal() {
+    if (journal_) {
+        std::fclose(journal_);
+        journal_ = nullptr;
+    }
+}
+
 }
@@ -2,34 +2,84 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <cstdio>
 #include <mutex>
+#include <utility>
+#include <map>
+#include <array>
+#include <cstdint>
 
 namespace fastget {
 
+// Completion state for a download, persisted next to the output: a bit per
+// finished block, plus exact byte ranges inside blocks that are only partly
+// done, so a restart re-requests only the missing bytes. The file is a packed
+// bitset snapshot followed by an append-only journal of completed byte
+// ranges: a checkpoint appends only what finished since the last one, and the
+// file is rewritten as a fresh snapshot once the journal outgrows the bitset.
+// The journal also carries the SHA-256 of finished blocks when pieces are
+// hashed during the download. A torn journal tail is ignored on load.
+// FASTGET1 files (one byte per block, no journal) still load.
 class ResumeState {
 public:
+    using Digest = std::array<uint8_t, 32>;
+
     explicit ResumeState(const std::string& path);
+    ~ResumeState();
+
+    ResumeState(const ResumeState&) = delete;
+    ResumeState& operator=(const ResumeState&) = delete;
 
     bool Load(size_t expected_total_size, size_t* out_chunk_size, size_t* out_chunk_count);
     void Initialize(size_t total_size, size_t chunk_size, size_t chunk_count);
     bool IsInitialized() const;
     bool IsChunkComplete(size_t chunk_id) const;
     void MarkCompleted(size_t chunk_id);
+    void MarkRangeCompleted(size_t start, size_t end);
     std::vector<size_t> GetCompletedChunks() const;
+    std::vector<std::pair<size_t, size_t>> GetCompletedRanges() const;
+    // Drops [start, end] from the completed state, e.g. after it failed
+    // verification. Forces a snapshot on the next save.
+    void ClearRange(size_t start, size_t end);
+    void SetBlockDigest(size_t block, const Digest& digest);
+    std::map<size_t, Digest> GetBlockDigests() const;
+    // Persists everything marked so far; the data it describes must already
+    // be durable. Appends to the journal unless a snapshot is due.
     void Save();
-    void MaybeSave();
+    // Rewrites the file as a snapshot with an empty journal.
+    void Compact();
+    // True once a checkpoint interval has passed since the last save and
+    // there is something new to save. `pending`: the caller holds progress of
+    // its own that it records just before saving.
+    bool IsSaveDue(bool pending = false) const;
 
 private:
-    void SaveLocked();
+    bool LoadSnapshot(std::FILE* file, bool packed);
+    void ApplyRange(size_t start, size_t end);
+    void ErasePartial(size_t start, size_t end);
+    // Both take what to write under mutex_ but write and sync without it,
+    // so marking ranges never waits for the disk. save_mutex_ keeps saves in
+    // order and guards the journal file.
+    bool AppendJournal();
+    void WriteSnapshot();
+    void CloseJournal();
 
     std::string path_;
     size_t total_size_ = 0;
     size_t chunk_size_ = 0;
     size_t chunk_count_ = 0;
     std::vector<uint8_t> completed_;
+    std::map<size_t, size_t> partial_; // finished [start, end] byte ranges inside unfinished blocks
     bool initialized_ = false;
-    bool dirty_ = false;
+
+    std::map<size_t, Digest> digests_;
+    std::vector<std::pair<size_t, size_t>> unsaved_; // ranges marked since the last save
+    std::vector<size_t> unsaved_digests_;
+    bool snapshot_due_ = false;
+    size_t journal_records_ = 0;
+    std::FILE* journal_ = nullptr;
     std::chrono::steady_clock::time_point last_save_;
+    std::mutex save_mutex_; // taken before mutex_
     mutable std::mutex mutex_;
 };
 
@@ -0,0 +1,605 @@
+#include "transfer_engine.hpp"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace fastget {
+
+static constexpr int kBudgetRetryDelayMs = 20;
+static constexpr int kBackpressureWaitMs = 2;
+static constexpr size_t kMinStealBytes = 256 * 1024;
+static constexpr size_t kStealAlignment = 64 * 1024;
+static constexpr double kMinStealEtaSeconds = 0.5;
+static constexpr double kMinHedgeEtaSeconds = 1.0;
+
+TransferEngine::TransferEngine(ChunkManager& chunks, const std::vector<std::string>& urls, const NetworkOptions& net_options, const EngineOptions& options)
+    : chunks_(chunks), urls_(urls), net_options_(net_options), options_(options),
+      mirrors_(urls.size(), options.per_mirror_connections) {
+    if (options_.max_connections < 1) options_.max_connections = 1;
+    for (const auto& url : urls_) hosts_.push_back(NetworkLayer::GetHost(url));
+    if (options_.initial_connections > 0) {
+        concurrency_ = std::make_unique<ConcurrencyController>(options_.initial_connections, options_.max_connections);
+    }
+    if (!options_.buffers) {
+        owned_buffers_ = std::make_unique<BufferPool>();
+        options_.buffers = owned_buffers_.get();
+    }
+
+    multi_ = curl_multi_init();
+    if (!multi_) return;
+    curl_multi_setopt(multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(options_.max_connections));
+
+#ifdef __linux__
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, TimerCallback);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+#endif
+}
+
+TransferEngine::~TransferEngine() {
+    for (auto& connection : connections_) {
+        if (connection->chunk) curl_multi_remove_handle(multi_, connection->easy);
+        curl_easy_cleanup(connection->easy);
+        if (connection->headers) curl_slist_free_all(connection->headers);
+    }
+    if (multi_) curl_multi_cleanup(multi_);
+#ifdef __linux__
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+#endif
+}
+
+bool TransferEngine::Run(const std::atomic<bool>& running, const std::atomic<bool>& paused) {
+    if (!multi_ || urls_.empty()) return false;
+#ifdef __linux__
+    if (epoll_fd_ < 0) return false;
+#endif
+
+    while (running && !fatal_) {
+        FillSlots(paused);
+        if (active_ == 0 && retries_.empty()) {
+            if (paused) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            break;
+        }
+
+        int max_wait_ms = 100;
+        if (!retries_.empty()) {
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& retry : retries_) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(retry.due - now).count();
+                max_wait_ms = static_cast<int>(std::clamp<long long>(wait, 0, max_wait_ms));
+            }
+        }
+
+        if (!throttled_.empty()) max_wait_ms = std::min(max_wait_ms, GetThrottleWait());
+
+        WaitForActivity(max_wait_ms);
+        ResumeThrottled();
+        DrainCompleted();
+        if (concurrency_) concurrency_->Update(std::chrono::steady_clock::now(), static_cast<int>(active_));
+        if (on_poll_) on_poll_();
+    }
+
+    return !fatal_;
+}
+
+void TransferEngine::ForEachInFlightChunk(const std::function<void(Chunk* chunk)>& fn) const {
+    // A hedge shares its chunk with the primary, which is the one that
+    // advances `persisted`.
+    for (const auto& connection : connections_) {
+        if (connection->chunk && !connection->hedge) fn(connection->chunk);
+    }
+    for (const auto& retry : retries_) fn(retry.chunk);
+}
+
+void TransferEngine::FillSlots(bool paused) {
+    if (paused) return;
+    starved_ = false;
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = retries_.begin(); it != retries_.end();) {
+        if (static_cast<int>(active_) >= ConnectionLimit() || starved_) return;
+        if (it->due > now) {
+            ++it;
+            continue;
+        }
+        size_t remaining = it->chunk->end - it->chunk->start - it->chunk->persisted + 1;
+        int mirror = mirrors_.Pick(remaining, now, it->avoid);
+        if (mirror < 0) {
+            ++it;
+            continue;
+        }
+        PendingRetry retry = *it;
+        it = retries_.erase(it);
+        StartTransfer(retry.chunk, mirror, retry.attempt, retry.hops);
+    }
+
+    while (static_cast<int>(active_) < ConnectionLimit() && !fatal_ && !starved_) {
+        // Every mirror at its own limit leaves the slot empty for now.
+        int mirror = mirrors_.Pick(chunks_.GetChunkSize(), now);
+        if (mirror < 0) break;
+
+        Chunk* chunk = chunks_.GetNextChunk();
+        if (!chunk) chunk = StealFromSlowest();
+        if (chunk) {
+            StartTransfer(chunk, mirror, 0, 0);
+        } else if (!HedgeSlowest()) {
+            break;
+        }
+    }
+}
+
+int TransferEngine::ConnectionLimit() const {
+    // Lowering the limit retires connections as their current transfer ends.
+    return concurrency_ ? concurrency_->GetLimit() : options_.max_connections;
+}
+
+Chunk* TransferEngine::StealFromSlowest() {
+    // Once nothing is left to carve, or the in-order window is full, an idle
+    // slot takes the unfetched second half of whichever transfer is furthest
+    // from finishing.
+    auto now = std::chrono::steady_clock::now();
+    Connection* victim = nullptr;
+    double victim_eta = kMinStealEtaSeconds;
+
+    for (const auto& connection : connections_) {
+        Chunk* chunk = connection->chunk;
+        if (!chunk || connection->hedge || connection->partner) continue;
+        size_t position = connection->offset + connection->received;
+        if (position > chunk->end || chunk->end - position + 1 < 2 * kMinStealBytes) continue;
+
+        // In order, the range nearest the head holds up everything behind it.
+        double eta = EstimateSecondsLeft(*connection, now);
+        if (eta > kMinStealEtaSeconds && (!victim || (options_.in_order ? chunk->start < victim->chunk->start : eta > victim_eta))) {
+            victim = connection.get();
+            victim_eta = eta;
+        }
+    }
+    if (!victim) return nullptr;
+
+    Chunk* chunk = victim->chunk;
+    size_t position = victim->offset + victim->received;
+    size_t split_at = position + (chunk->end - position + 1) / 2;
+    split_at -= split_at % kStealAlignment;
+    if (split_at <= position) return nullptr;
+    return chunks_.SplitChunk(chunk->id, split_at);
+}
+
+bool TransferEngine::HedgeSlowest() {
+    // End game: ranges too small to split are raced against another mirror,
+    // and whichever copy finishes first wins.
+    if (urls_.size() < 2) return false;
+
+    auto now = std::chrono::steady_clock::now();
+    Connection* slowest = nullptr;
+    double slowest_eta = kMinHedgeEtaSeconds;
+    for (const auto& connection : connections_) {
+        if (!connection->chunk || connection->hedge || connection->partner) continue;
+        double eta = EstimateSecondsLeft(*connection, now);
+        if (eta > kMinHedgeEtaSeconds && (!slowest || (options_.in_order ? connection->chunk->start < slowest->chunk->start : eta > slowest_eta))) {
+            slowest = connection.get();
+            slowest_eta = eta;
+        }
+    }
+    if (!slowest) return false;
+
+    size_t remaining = slowest->chunk->end - (slowest->offset + slowest->received) + 1;
+    int mirror = mirrors_.Pick(remaining, now, static_cast<int>(slowest->url_index));
+    if (mirror < 0 || mirror == static_cast<int>(slowest->url_index)) return false;
+    return StartTransfer(slowest->chunk, mirror, 0, 0, slowest);
+}
+
+double TransferEngine::EstimateSecondsLeft(const Connection& connection, std::chrono::steady_clock::time_point now) const {
+    size_t position = connection.offset + connection.received;
+    if (position > connection.chunk->end) return 0.0;
+
+    size_t remaining = connection.chunk->end - position + 1;
+    std::chrono::duration<double> elapsed = now - connection.start_time;
+    if (connection.received > 0 && elapsed.count() > 0) {
+        return remaining / (connection.received / elapsed.count());
+    }
+    // No data yet: only call it stalled once it has had a fair chance.
+    return elapsed.count() > kMinStealEtaSeconds ? elapsed.count() + remaining : 0.0;
+}
+
+bool TransferEngine::StartTransfer(Chunk* chunk, size_t url_index, int attempt, size_t hops, Connection* hedged) {
+    Connection* connection = AcquireConnection();
+    if (!connection) {
+        if (!hedged) HandleFailure(chunk, url_index, attempt, hops);
+        return false;
+    }
+
+    connection->chunk = chunk;
+    connection->url_index = url_index;
+    connection->attempt = attempt;
+    connection->hops = hops;
+    connection->offset = hedged ? hedged->offset + hedged->received : chunk->start + chunk->persisted;
+    connection->received = 0;
+    connection->range_start = -1;
+    connection->validated = false;
+    connection->buffered = 0;
+    connection->error[0] = '\0';
+    connection->start_time = std::chrono::steady_clock::now();
+
+    if (connection->offset > chunk->end) {
+        idle_.push_back(connection);
+        if (on_success_) on_success_(chunk, 0.0);
+        return true;
+    }
+
+    if (options_.sink != SinkMode::Direct) {
+        // Under a memory budget a buffered transfer settles for a staging
+        // buffer; if even that does not fit, the chunk waits for memory.
+        size_t size = options_.sink == SinkMode::Buffered ? chunk->end - connection->offset + 1 : options_.stream_buffer_size;
+        connection->buffer = options_.buffers->Acquire(size);
+        if (!connection->buffer && size > options_.stream_buffer_size) {
+            connection->buffer = options_.buffers->Acquire(options_.stream_buffer_size);
+        }
+        // The range at the head of in-order output is sent on as it arrives,
+        // so it can go unstaged; spans held behind it must never starve it.
+        // Nor is there anything to wait for while none of the budget is in
+        // use, e.g. when the limit is below a single staging buffer.
+        bool head = options_.in_order && connection->offset <= chunks_.GetWindowStart();
+        bool unstaged = head || options_.buffers->GetInUse() == 0;
+        if (!connection->buffer && !unstaged) {
+            connection->chunk = nullptr;
+            idle_.push_back(connection);
+            starved_ = true;
+            if (hedged) return false;
+            auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(kBudgetRetryDelayMs);
+            retries_.push_back({chunk, attempt, hops, -1, due});
+            return false;
+        }
+    }
+
+    CURL* curl = connection->easy;
+    std::string range = std::to_string(connection->offset) + "-" + std::to_string(chunk->end);
+    curl_easy_setopt(curl, CURLOPT_URL, urls_[url_index].c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+
+    if (curl_multi_add_handle(multi_, curl) != CURLM_OK) {
+        connection->chunk = nullptr;
+        connection->buffer.Release();
+        idle_.push_back(connection);
+        if (!hedged) HandleFailure(chunk, url_index, attempt, hops);
+        return false;
+    }
+
+    mirrors_.OnStart(url_index);
+    if (hedged) {
+        connection->hedge = true;
+        connection->partner = hedged;
+        hedged->partner = connection;
+    }
+    active_++;
+    peak_active_ = std::max(peak_active_, active_);
+    return true;
+}
+
+TransferEngine::Connection* TransferEngine::AcquireConnection() {
+    if (!idle_.empty()) {
+        Connection* connection = idle_.back();
+        idle_.pop_back();
+        return connection;
+    }
+
+    auto connection = std::make_unique<Connection>();
+    connection->engine = this;
+    connection->easy = curl_easy_init();
+    if (!connection->easy) return nullptr;
+
+    CURL* curl = connection->easy;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ReceiveCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, connection.get());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, connection.get());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, connection->error);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, connection.get());
+    NetworkLayer::ApplyOptions(curl, net_options_, &connection->headers);
+
+    connections_.push_back(std::move(connection));
+    return connections_.back().get();
+}
+
+void TransferEngine::FinishTransfer(CURL* easy, CURLcode) {
+    Connection* connection = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &connection);
+    if (!connection || !connection->chunk) return;
+
+    // Whatever arrived in order is valid even if the transfer failed, so it is
+    // persisted and a retry only asks for the rest of the range.
+    Chunk* chunk = connection->chunk;
+    bool flushed = connection->validated && Flush(*connection);
+    bool complete = flushed && connection->offset + connection->received > chunk->end;
+
+    double ttfb = 0.0;
+    double total = 0.0;
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total);
+    mirrors_.OnResult(connection->url_index, complete, connection->received, ttfb, total, std::chrono::steady_clock::now());
+
+    // A winning hedge only covers the tail it asked for; the primary has
+    // everything before that, possibly still staged.
+    Connection* partner = connection->partner;
+    if (complete && connection->hedge && !Flush(*partner)) {
+        ReleaseConnection(connection);
+        connection = partner;
+        partner = nullptr;
+        complete = false;
+    }
+
+    if (complete) {
+        std::chrono::duration<double> diff = std::chrono::steady_clock::now() - connection->start_time;
+        double speed = diff.count() > 0 ? connection->received / diff.count() : 0.0;
+        if (partner) ReleaseConnection(partner);
+        ReleaseConnection(connection);
+        if (on_success_) on_success_(chunk, speed);
+        return;
+    }
+
+    // A losing hedge just goes away; the primary keeps its own retry budget.
+    if (connection->hedge) {
+        ReleaseConnection(connection);
+        return;
+    }
+
+    // Failures of a circuit-broken mirror say nothing about congestion.
+    if (concurrency_ && !mirrors_.IsBroken(connection->url_index)) concurrency_->RecordError();
+    size_t url_index = connection->url_index;
+    int attempt = connection->attempt;
+    size_t hops = connection->hops;
+    if (partner) ReleaseConnection(partner);
+    ReleaseConnection(connection);
+    HandleFailure(chunk, url_index, attempt, hops);
+}
+
+void TransferEngine::ReleaseConnection(Connection* connection) {
+    curl_multi_remove_handle(multi_, connection->easy);
+    mirrors_.OnRelease(connection->url_index);
+    if (connection->throttled) {
+        auto it = std::find(throttled_.begin(), throttled_.end(), connection);
+        if (it != throttled_.end()) throttled_.erase(it);
+        connection->throttled = false;
+    }
+    if (connection->partner) connection->partner->partner = nullptr;
+    connection->partner = nullptr;
+    connection->hedge = false;
+    connection->chunk = nullptr;
+    connection->buffer.Release();
+    active_--;
+    idle_.push_back(connection);
+}
+
+void TransferEngine::HandleFailure(Chunk* chunk, size_t url_index, int attempt, size_t hops) {
+    // Fail over to another mirror right away until as many have been tried as
+    // there are, then back off before the next attempt.
+    int avoid = static_cast<int>(url_index);
+    if (hops + 1 < urls_.size()) {
+        retries_.push_back({chunk, attempt, hops + 1, avoid, std::chrono::steady_clock::now()});
+        return;
+    }
+    if (attempt < options_.retries) {
+        auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(options_.retry_delay_ms);
+        retries_.push_back({chunk, attempt + 1, 0, avoid, due});
+        return;
+    }
+
+    chunks_.MarkFailed(chunk->id);
+    if (on_failure_) on_failure_(chunk);
+    fatal_ = true;
+}
+
+size_t TransferEngine::HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+    auto* connection = static_cast<Connection*>(userp);
+    std::string header(buffer, size * nitems);
+    // Each response of a redirect chain starts with its own status line.
+    if (header.compare(0, 5, "HTTP/") == 0) {
+        connection->range_start = -1;
+    } else {
+        long start = NetworkLayer::GetRangeStart(header);
+        if (start >= 0) connection->range_start = start;
+    }
+    return size * nitems;
+}
+
+size_t TransferEngine::ReceiveCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto* connection = static_cast<Connection*>(userp);
+    TransferEngine* engine = connection->engine;
+    size_t total = size * nmemb;
+
+    // Out of credit or a writer that is behind: curl holds on to this data
+    // and redelivers it once the loop resumes the transfer.
+    RateLimiter* limiter = engine->options_.limiter;
+    bool backlogged = engine->on_backpressure_ && engine->on_backpressure_();
+    if (backlogged || (limiter && !limiter->TryAcquire(engine->hosts_[connection->url_index], total))) {
+        connection->throttled = true;
+        engine->throttled_.push_back(connection);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    return engine->Receive(*connection, static_cast<const char*>(contents), total) ? total : 0;
+}
+
+void TransferEngine::ResumeThrottled() {
+    // Unpausing may deliver data right away and re-throttle the transfer,
+    // so work from a snapshot of the list.
+    std::vector<Connection*> waiting;
+    waiting.swap(throttled_);
+    bool backlogged = on_backpressure_ && on_backpressure_();
+    for (Connection* connection : waiting) {
+        if (!connection->throttled) continue; // released along with a hedge partner
+        if (backlogged || (options_.limiter && options_.limiter->GetWait(hosts_[connection->url_index]).count() > 0)) {
+            throttled_.push_back(connection);
+            continue;
+        }
+        connection->throttled = false;
+        // A transfer that fails while redelivering is not reported through
+        // curl_multi_info_read, so it is finished here.
+        CURLcode result = curl_easy_pause(connection->easy, CURLPAUSE_CONT);
+        if (result != CURLE_OK) FinishTransfer(connection->easy, result);
+    }
+}
+
+int TransferEngine::GetThrottleWait() {
+    // A writer catches up as its completions are reaped, once per iteration.
+    if (on_backpressure_ && on_backpressure_()) return kBackpressureWaitMs;
+    long long wait = 100;
+    if (!options_.limiter) return static_cast<int>(wait);
+    for (Connection* connection : throttled_) {
+        wait = std::min<long long>(wait, options_.limiter->GetWait(hosts_[connection->url_index]).count());
+    }
+    return static_cast<int>(wait);
+}
+
+bool TransferEngine::Receive(Connection& connection, const char* data, size_t size) {
+    if (!connection.validated) {
+        long response_code = 0;
+        curl_easy_getinfo(connection.easy, CURLINFO_RESPONSE_CODE, &response_code);
+        // A 200 carries the whole entity, which only lines up with the range when it starts at zero.
+        if (response_code == 200 && connection.offset != 0) {
+            // No range will be honoured either; retrying is pointless.
+            ranges_ignored_ = true;
+            fatal_ = true;
+            return false;
+        }
+        if (response_code != 206 && response_code != 200) return false;
+        // A 206 for some other range would land at the wrong offset; the
+        // retry asks again, possibly of another mirror.
+        if (response_code == 206 && connection.range_start != static_cast<long>(connection.offset)) return false;
+        connection.validated = true;
+    }
+
+    size_t wanted = connection.chunk->end - connection.offset + 1;
+    if (connection.received >= wanted) return false;
+    size = std::min(size, wanted - connection.received);
+    if (concurrency_ && !connection.hedge) concurrency_->RecordBytes(size);
+
+    if (options_.sink == SinkMode::Direct || !connection.buffer) {
+        size_t offset = connection.offset + connection.received;
+        if (on_write_ && !on_write_(offset, data, size)) return false;
+        ReportWritten(connection, offset, size);
+        connection.received += size;
+        if (!connection.hedge) connection.chunk->persisted = offset + size - connection.chunk->start;
+        return true;
+    }
+
+    // Buffered transfers normally hold the whole range and only flush at the
+    // end; a smaller buffer simply flushes whenever it fills up.
+    while (size > 0) {
+        size_t room = connection.buffer.capacity() - connection.buffered;
+        size_t n = std::min(room, size);
+        std::memcpy(connection.buffer.data() + connection.buffered, data, n);
+        connection.buffered += n;
+        connection.received += n;
+        data += n;
+        size -= n;
+        if (connection.buffered >= connection.buffer.capacity() && !Flush(connection)) return false;
+    }
+    return true;
+}
+
+bool TransferEngine::Flush(Connection& connection) {
+    if (connection.buffered == 0) return true;
+    size_t offset = connection.offset + connection.received - connection.buffered;
+    if (on_write_ && !on_write_(offset, connection.buffer.data(), connection.buffered)) return false;
+    ReportWritten(connection, offset, connection.buffered);
+    if (!connection.hedge) connection.chunk->persisted = offset + connection.buffered - connection.chunk->start;
+    connection.buffered = 0;
+    return true;
+}
+
+void TransferEngine::ReportWritten(const Connection& connection, size_t offset, size_t size) {
+    if (!on_progress_) return;
+    // Whatever the partner has already written of this span is not news.
+    if (const Connection* partner = connection.partner) {
+        size_t begin = std::max(offset, partner->offset);
+        size_t end = std::min(offset + size, partner->offset + partner->received - partner->buffered);
+        if (end > begin) size -= end - begin;
+    }
+    if (size > 0) on_progress_(size);
+}
+
+void TransferEngine::DrainCompleted() {
+    int pending = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi_, &pending)) {
+        if (msg->msg == CURLMSG_DONE) {
+            FinishTransfer(msg->easy_handle, msg->data.result);
+        }
+    }
+}
+
+int TransferEngine::TimerCallback(CURLM*, long timeout_ms, void* userp) {
+    auto* engine = static_cast<TransferEngine*>(userp);
+    if (timeout_ms < 0) {
+        engine->timer_armed_ = false;
+    } else {
+        engine->timer_armed_ = true;
+        engine->timer_deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+int TransferEngine::SocketCallback(CURL*, curl_socket_t s, int what, void* userp, void*) {
+    auto* engine = static_cast<TransferEngine*>(userp);
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(engine->epoll_fd_, EPOLL_CTL_DEL, s, nullptr);
+        return 0;
+    }
+
+    epoll_event ev{};
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+    if (epoll_ctl(engine->epoll_fd_, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT) {
+        epoll_ctl(engine->epoll_fd_, EPOLL_CTL_ADD, s, &ev);
+    }
+    return 0;
+}
+
+void TransferEngine::WaitForActivity(int max_wait_ms) {
+    int still_running = 0;
+    int wait_ms = max_wait_ms;
+    if (timer_armed_) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(timer_deadline_ - std::chrono::steady_clock::now()).count();
+        wait_ms = static_cast<int>(std::clamp<long long>(remaining, 0, max_wait_ms));
+    }
+
+    epoll_event events[64];
+    int count = epoll_wait(epoll_fd_, events, 64, wait_ms);
+    for (int i = 0; i < count; ++i) {
+        int flags = 0;
+        if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+        if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+        curl_multi_socket_action(multi_, events[i].data.fd, flags, &still_running);
+    }
+
+    if (timer_armed_ && std::chrono::steady_clock::now() >= timer_deadline_) {
+        timer_armed_ = false;
+        curl_multi_socket_action(multi_, CURL_SOCKET_TIMEOUT, 0, &still_running);
+    }
+}
+
+#else
+
+void TransferEngine::WaitForActivity(int max_wait_ms) {
+    int still_running = 0;
+    curl_multi_perform(multi_, &still_running);
+    curl_multi_poll(multi_, nullptr, 0, max_wait_ms, nullptr);
+    curl_multi_perform(multi_, &still_running);
+}
+
+#endif
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "network.hpp"
+#include "chunk_manager.hpp"
+#include "buffer_pool.hpp"
+#include "concurrency_controller.hpp"
+#include "mirror_scheduler.hpp"
+#include "rate_limiter.hpp"
+#include <curl/curl.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fastget {
+
+enum class SinkMode {
+    Buffered,  // hold each range in memory and write it once complete
+    Streaming, // write received spans to their file offset as they arrive
+    Direct     // hand each span to the writer unstaged (memory-mapped output)
+};
+
+struct EngineOptions {
+    int max_connections = 8;
+    int initial_connections = 0; // adapt up to max_connections from here; 0 keeps the count fixed
+    int per_mirror_connections = 0; // 0 = no per-mirror cap
+    int retries = 2;
+    int retry_delay_ms = 500;
+    SinkMode sink = SinkMode::Streaming;
+    size_t stream_buffer_size = 256 * 1024;
+    BufferPool* buffers = nullptr; // engine-private pool when null
+    RateLimiter* limiter = nullptr; // unthrottled when null
+    bool in_order = false; // output is consumed in file order; steal and hedge nearest the head first
+};
+
+// Drives every range transfer of a download from a single event loop on top
+// of curl_multi. On Linux the loop is epoll based (curl_multi_socket_action);
+// other platforms fall back to curl_multi_poll.
+class TransferEngine {
+public:
+    using WriteHandler = std::function<bool(size_t offset, const char* data, size_t size)>;
+    using ProgressHandler = std::function<void(size_t bytes)>;
+    using SuccessHandler = std::function<void(Chunk* chunk, double speed)>;
+    using FailureHandler = std::function<void(Chunk* chunk)>;
+    using PollHandler = std::function<void()>;
+    using BackpressureHandler = std::function<bool()>;
+
+    TransferEngine(ChunkManager& chunks, const std::vector<std::string>& urls, const NetworkOptions& net_options, const EngineOptions& options);
+    ~TransferEngine();
+
+    TransferEngine(const TransferEngine&) = delete;
+    TransferEngine& operator=(const TransferEngine&) = delete;
+
+    void SetWriteHandler(WriteHandler handler) { on_write_ = std::move(handler); }
+    // Reports bytes written for the first time; where the two sides of a
+    // hedged pair overlap, only the first write of a byte counts.
+    void SetProgressHandler(ProgressHandler handler) { on_progress_ = std::move(handler); }
+    void SetSuccessHandler(SuccessHandler handler) { on_success_ = std::move(handler); }
+    void SetFailureHandler(FailureHandler handler) { on_failure_ = std::move(handler); }
+    // Runs on the loop thread once per iteration, e.g. to reap async disk writes.
+    void SetPollHandler(PollHandler handler) { on_poll_ = std::move(handler); }
+    // Asked before data is handed over; while it returns true, transfers are
+    // paused like throttled ones, e.g. because the disk queue is full.
+    void SetBackpressureHandler(BackpressureHandler handler) { on_backpressure_ = std::move(handler); }
+
+    // Runs until every chunk is downloaded, `running` is cleared, or a chunk
+    // exhausts its retries on all URLs. Returns false in the last case.
+    bool Run(const std::atomic<bool>& running, const std::atomic<bool>& paused);
+
+    // Set when Run() stopped because the server answered a range past the
+    // start with the whole entity; the download has to go as one stream.
+    bool RangesIgnored() const { return ranges_ignored_; }
+    size_t GetActiveTransfers() const { return active_; }
+    size_t GetPeakTransfers() const { return peak_active_; }
+    const MirrorScheduler& GetMirrors() const { return mirrors_; }
+    // Visits every chunk that is being transferred or waiting for a retry.
+    // Loop thread only, e.g. from the poll handler.
+    void ForEachInFlightChunk(const std::function<void(Chunk* chunk)>& fn) const;
+
+private:
+    // Worker context: the easy handle and its request options live for the
+    // whole download, only the URL and range change between chunks.
+    struct Connection {
+        TransferEngine* engine = nullptr;
+        CURL* easy = nullptr;
+        curl_slist* headers = nullptr;
+        char error[CURL_ERROR_SIZE];
+
+        Chunk* chunk = nullptr;
+        size_t url_index = 0;
+        int attempt = 0;
+        size_t hops = 0;     // other mirrors already tried during this attempt
+        size_t offset = 0;   // first byte requested by this transfer
+        size_t received = 0; // body bytes accepted for [offset, chunk->end]
+        long range_start = -1; // Content-Range start of the current response
+        bool validated = false;
+        BufferPool::Buffer buffer; // whole range when buffered, staging area when streaming
+        size_t buffered = 0;
+        bool hedge = false;             // duplicate request for another connection's chunk
+        Connection* partner = nullptr;  // the other side of a hedged pair
+        bool throttled = false;         // paused until the rate limiter has credit or the writer catches up
+        std::chrono::steady_clock::time_point start_time;
+    };
+
+    struct PendingRetry {
+        Chunk* chunk;
+        int attempt;
+        size_t hops;
+        int avoid; // mirror that just failed the chunk, -1 for none
+        std::chrono::steady_clock::time_point due;
+    };
+
+    void FillSlots(bool paused);
+    int ConnectionLimit() const;
+    bool StartTransfer(Chunk* chunk, size_t url_index, int attempt, size_t hops, Connection* hedged = nullptr);
+    Chunk* StealFromSlowest();
+    bool HedgeSlowest();
+    double EstimateSecondsLeft(const Connection& connection, std::chrono::steady_clock::time_point now) const;
+    Connection* AcquireConnection();
+    void FinishTransfer(CURL* easy, CURLcode result);
+    void ReleaseConnection(Connection* connection);
+    void HandleFailure(Chunk* chunk, size_t url_index, int attempt, size_t hops);
+    bool Receive(Connection& connection, const char* data, size_t size);
+    bool Flush(Connection& connection);
+    void ReportWritten(const Connection& connection, size_t offset, size_t size);
+    void ResumeThrottled();
+    int GetThrottleWait();
+    void WaitForActivity(int max_wait_ms);
+    void DrainCompleted();
+
+    static size_t ReceiveCallback(void* contents, size_t size, size_t nmemb, void* userp);
+    static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp);
+    static int TimerCallback(CURLM* multi, long timeout_ms, void* userp);
+#ifdef __linux__
+    static int SocketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+#endif
+
+    ChunkManager& chunks_;
+    std::vector<std::string> urls_;
+    std::vector<std::string> hosts_;
+    NetworkOptions net_options_;
+    EngineOptions options_;
+
+    std::unique_ptr<BufferPool> owned_buffers_;
+    CURLM* multi_ = nullptr;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::vector<Connection*> idle_;
+    size_t active_ = 0;
+    size_t peak_active_ = 0;
+    std::unique_ptr<ConcurrencyController> concurrency_;
+    MirrorScheduler mirrors_;
+    std::vector<PendingRetry> retries_;
+    std::vector<Connection*> throttled_;
+    bool fatal_ = false;
+    bool ranges_ignored_ = false;
+    bool starved_ = false;
+
+    WriteHandler on_write_;
+    ProgressHandler on_progress_;
+    SuccessHandler on_success_;
+    FailureHandler on_failure_;
+    PollHandler on_poll_;
+    BackpressureHandler on_backpressure_;
+
+    bool timer_armed_ = false;
+    std::chrono::steady_clock::time_point timer_deadline_;
+#ifdef __linux__
+    int epoll_fd_ = -1;
+#endif
+};
+
+}
@@ -5,10 +5,24 @@
 
 namespace fastget {
 
-void UI::PrintHeader(const std::string& filename, size_t size, int connections) {
-    std::cout << "Downloading: " << filename << std::endl;
-    std::cout << "Size: " << FormatSize(size) << std::endl;
-    std::cout << "Connections: " << connections << std::endl;
+static std::ostream* report_stream = &std::cout;
+
+void UI::ReportToStderr() {
+    report_stream = &std::cerr;
+}
+
+std::ostream& UI::Out() {
+    return *report_stream;
+}
+
+void UI::PrintHeader(const std::string& filename, size_t size, int connections, bool adaptive) {
+    Out() << "Downloading: " << filename << std::endl;
+    Out() << "Size: " << (size > 0 ? FormatSize(size) : "unknown") << std::endl;
+    if (adaptive) {
+        Out() << "Connections: adaptive, up to " << connections << std::endl;
+    } else {
+        Out() << "Connections: " << connections << std::endl;
+    }
 }
 
 void UI::UpdateProgress(size_t downloaded, size_t total, double speed_bps, std::chrono::steady_clock::time_point start_time) {
@@ -17,42 +31,105 @@ void UI::UpdateProgress(size_t downloaded, size_t total, double speed_bps, std::
     int barWidth = 30;
     int pos = static_cast<int>(barWidth * percent / 100.0);
 
-    std::cout << "\x1b[2K\rProgress: " << std::fixed << std::setprecision(1) << std::setw(5) << percent << "% [";
+    Out() << "\x1b[2K\rProgress: " << std::fixed << std::setprecision(1) << std::setw(5) << percent << "% [";
     for (int i = 0; i < barWidth; ++i) {
-        if (i < pos) std::cout << "█";
-        else if (i == pos) std::cout << "█";
-        else std::cout << "░";
+        if (i < pos) Out() << "█";
+        else if (i == pos) Out() << "█";
+        else Out() << "░";
     }
-    std::cout << "] " << FormatSpeed(speed_bps);
+    Out() << "] " << FormatSpeed(speed_bps);
 
     if (speed_bps > 0) {
         long remaining_bytes = total - downloaded;
         long eta_seconds = static_cast<long>(remaining_bytes / speed_bps);
-        std::cout << " ETA: " << FormatDuration(eta_seconds);
+        Out() << " ETA: " << FormatDuration(eta_seconds);
     }
 
-    std::cout << std::flush;
+    Out() << std::flush;
+}
+
+void UI::UpdateStreamProgress(size_t downloaded, double speed_bps) {
+    Out() << "\x1b[2K\rProgress: " << FormatSize(downloaded) << " " << FormatSpeed(speed_bps) << std::flush;
+}
+
+void UI::PrintStreamFallback() {
+    Out() << "\x1b[2K\rServer ignores range requests; continuing as a single stream" << std::endl;
 }
 
 void UI::PrintFooter(bool success, const std::string& message) {
-    std::cout << std::endl;
+    Out() << std::endl;
     if (success) {
-        std::cout << "Download complete!" << std::endl;
+        Out() << "Download complete!" << std::endl;
     } else {
         std::cerr << "Download failed: " << message << std::endl;
     }
 }
 
 void UI::PrintSummary(size_t total, size_t downloaded, double avg_speed_bps, long duration_seconds, bool resumed, size_t resumed_bytes, int connections) {
-    std::cout << "Summary" << std::endl;
-    std::cout << "Total: " << FormatSize(total) << std::endl;
-    std::cout << "Downloaded: " << FormatSize(downloaded) << std::endl;
-    std::cout << "Average speed: " << FormatSpeed(avg_speed_bps) << std::endl;
-    std::cout << "Time: " << FormatDuration(duration_seconds) << std::endl;
+    Out() << "Summary" << std::endl;
+    Out() << "Total: " << FormatSize(total) << std::endl;
+    Out() << "Downloaded: " << FormatSize(downloaded) << std::endl;
+    Out() << "Average speed: " << FormatSpeed(avg_speed_bps) << std::endl;
+    Out() << "Time: " << FormatDuration(duration_seconds) << std::endl;
     if (resumed) {
-        std::cout << "Resumed: " << FormatSize(resumed_bytes) << std::endl;
+        Out() << "Resumed: " << FormatSize(resumed_bytes) << std::endl;
+    }
+    Out() << "Connections: " << connections << std::endl;
+}
+
+void UI::PrintBufferUsage(size_t peak_bytes) {
+    Out() << "Peak buffer memory: " << FormatSize(peak_bytes) << std::endl;
+}
+
+void UI::PrintReorderUsage(size_t peak_bytes) {
+    Out() << "Peak reorder backlog: " << FormatSize(peak_bytes) << std::endl;
+}
+
+void UI::PrintDecompressed(size_t bytes) {
+    Out() << "Decompressed: " << FormatSize(bytes) << std::endl;
+}
+
+void UI::PrintMirrorUsage(const std::string& url, size_t bytes) {
+    Out() << "From " << url << ": " << FormatSize(bytes) << std::endl;
+}
+
+void UI::PrintPieceRefetch(size_t piece, size_t start, size_t end) {
+    Out() << "\x1b[2K\rPiece " << piece << " (bytes " << start << "-" << end << ") failed verification, fetching it again" << std::endl;
+}
+
+void UI::PrintExistingPieces(size_t kept_bytes, size_t total) {
+    Out() << "Existing file: kept " << FormatSize(kept_bytes) << " of " << FormatSize(total) << " that matched the manifest" << std::endl;
+}
+
+void UI::PrintSeedReuse(size_t reused_bytes, size_t total) {
+    Out() << "Seed file: reused " << FormatSize(reused_bytes) << " of " << FormatSize(total) << ", fetching the rest" << std::endl;
+}
+
+void UI::PrintTreeDigest(const std::string& digest) {
+    Out() << "Tree digest (SHA-256): " << digest << std::endl;
+}
+
+void UI::UpdateBatchProgress(size_t files_done, size_t files_total, size_t active, size_t downloaded, double speed_bps) {
+    Out() << "\x1b[2K\rFiles: " << files_done << "/" << files_total << " | Active: " << active
+              << " | " << FormatSize(downloaded) << " | " << FormatSpeed(speed_bps) << std::flush;
+}
+
+void UI::PrintBatchResult(const std::string& filename, size_t size, bool success, const std::string& error) {
+    Out() << "\x1b[2K\r" << std::flush;
+    if (success) {
+        Out() << "Done: " << filename << " (" << FormatSize(size) << ")" << std::endl;
+    } else {
+        std::cerr << "Failed: " << filename << (error.empty() ? "" : ": " + error) << std::endl;
     }
-    std::cout << "Connections: " << connections << std::endl;
+}
+
+void UI::PrintBatchSummary(size_t files, size_t failed, size_t downloaded, double avg_speed_bps, long duration_seconds, int peak_connections) {
+    Out() << "\x1b[2K\rSummary" << std::endl;
+    Out() << "Files: " << files - failed << " of " << files << " downloaded" << std::endl;
+    Out() << "Downloaded: " << FormatSize(downloaded) << std::endl;
+    Out() << "Average speed: " << FormatSpeed(avg_speed_bps) << std::endl;
+    Out() << "Time: " << FormatDuration(duration_seconds) << std::endl;
+    Out() << "Peak connections: " << peak_connections << std::endl;
 }
 
 std::string UI::FormatSize(size_t bytes) {
@@ -1,17 +1,39 @@
 #pragma once
 #include <string>
 #include <chrono>
+#include <iosfwd>
 
 namespace fastget {
 
 class UI {
 public:
-    static void PrintHeader(const std::string& filename, size_t size, int connections);
+    // Progress and summaries go to stderr instead, e.g. while the download
+    // itself is written to stdout.
+    static void ReportToStderr();
+
+    static void PrintHeader(const std::string& filename, size_t size, int connections, bool adaptive = false);
     static void UpdateProgress(size_t downloaded, size_t total, double speed_bps, std::chrono::steady_clock::time_point start_time);
+    // For a stream whose length is not known.
+    static void UpdateStreamProgress(size_t downloaded, double speed_bps);
+    static void PrintStreamFallback();
     static void PrintFooter(bool success, const std::string& message = "");
     static void PrintSummary(size_t total, size_t downloaded, double avg_speed_bps, long duration_seconds, bool resumed, size_t resumed_bytes, int connections);
+    static void PrintBufferUsage(size_t peak_bytes);
+    static void PrintReorderUsage(size_t peak_bytes);
+    static void PrintDecompressed(size_t bytes);
+    static void PrintMirrorUsage(const std::string& url, size_t bytes);
+    static void PrintPieceRefetch(size_t piece, size_t start, size_t end);
+    static void PrintExistingPieces(size_t kept_bytes, size_t total);
+    static void PrintSeedReuse(size_t reused_bytes, size_t total);
+    static void PrintTreeDigest(const std::string& digest);
+
+    // Batch mode: one line per finished file under a shared progress line.
+    static void UpdateBatchProgress(size_t files_done, size_t files_total, size_t active, size_t downloaded, double speed_bps);
+    static void PrintBatchResult(const std::string& filename, size_t size, bool success, const std::string& error);
+    static void PrintBatchSummary(size_t files, size_t failed, size_t downloaded, double avg_speed_bps, long duration_seconds, int peak_connections);
 
 private:
+    static std::ostream& Out();
     static std::string FormatSize(size_t bytes);
     static std::string FormatSpeed(double speed_bps);
     static std::string FormatDuration(long seconds);
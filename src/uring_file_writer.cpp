@@ -0,0 +1,351 @@
+#include "uring_file_writer.hpp"
+
+#ifdef FASTGET_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+namespace fastget {
+
+static constexpr unsigned kQueueDepth = 32;
+static constexpr size_t kSlotCount = 16;
+static constexpr size_t kSlotSize = 256 * 1024;
+
+static int UringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int UringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int result;
+    do {
+        result = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+static int UringRegister(int ring_fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+UringFileWriter::UringFileWriter(const std::string& filename, BufferPool* buffers) : FileWriter(filename), buffers_(buffers) {}
+
+UringFileWriter::~UringFileWriter() {
+    Close();
+}
+
+bool UringFileWriter::Open() {
+    if (!FileWriter::Open()) return false;
+    // Without a usable ring (old kernel, seccomp, memlock limits) we simply
+    // keep writing synchronously through pwrite.
+    if (ring_fd_ < 0 && !SetupRing()) TeardownRing();
+    return true;
+}
+
+bool UringFileWriter::SetupRing() {
+    io_uring_params params{};
+    ring_fd_ = UringSetup(kQueueDepth, &params);
+    if (ring_fd_ < 0) return false;
+
+    sq_entries_ = params.sq_entries;
+    cq_entries_ = params.cq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    void* sq = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return false;
+    sq_ring_ = sq;
+
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        void* cq = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return false;
+        cq_ring_ = cq;
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq_base = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+
+    char* cq_base = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+    if (UringRegister(ring_fd_, IORING_REGISTER_FILES, &fd_, 1) != 0) return false;
+
+    void* memory = mmap(nullptr, kSlotCount * kSlotSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    slot_memory_ = static_cast<char*>(memory);
+
+    slots_.clear();
+    slots_.resize(kSlotCount);
+    std::vector<iovec> iovecs(kSlotCount);
+    for (size_t i = 0; i < kSlotCount; ++i) {
+        slots_[i].data = slot_memory_ + i * kSlotSize;
+        iovecs[i].iov_base = slots_[i].data;
+        iovecs[i].iov_len = kSlotSize;
+    }
+    // Registered buffers count against RLIMIT_MEMLOCK; plain WRITE still
+    // avoids blocking if registration is refused.
+    fixed_buffers_ = UringRegister(ring_fd_, IORING_REGISTER_BUFFERS, iovecs.data(), kSlotCount) == 0;
+    return true;
+}
+
+void UringFileWriter::TeardownRing() {
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+    if (slot_memory_) munmap(slot_memory_, kSlotCount * kSlotSize);
+    sqes_ = nullptr;
+    cq_ring_ = nullptr;
+    sq_ring_ = nullptr;
+    ring_fd_ = -1;
+    slot_memory_ = nullptr;
+    slots_.clear();
+    registered_busy_ = 0;
+    in_flight_ = 0;
+    unsubmitted_ = 0;
+}
+
+bool UringFileWriter::WriteAt(size_t offset, const char* data, size_t size) {
+    if (ring_fd_ < 0) return FileWriter::WriteAt(offset, data, size);
+
+    std::vector<Barrier> ready;
+    bool ok = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (size > 0 && !failed_) {
+            if (!HasSqRoom()) {
+                // An enter may take only part of the queue, so go by the
+                // entries the kernel has actually consumed.
+                Submit();
+                if (!HasSqRoom() && !failed_) Reap(true, ready);
+                continue;
+            }
+            int index = AcquireSlot();
+            if (index < 0) {
+                // Nothing left to borrow under the memory limit: the only
+                // case in which a write waits for the disk.
+                Reap(true, ready);
+                continue;
+            }
+            Slot& slot = slots_[index];
+            size_t n = std::min(size, kSlotSize);
+            std::memcpy(slot.data, data, n);
+            slot.busy = true;
+            if (static_cast<size_t>(index) < kSlotCount) registered_busy_++;
+            slot.seq = next_seq_++;
+            slot.offset = offset;
+            slot.size = n;
+
+            unsigned tail = *sq_tail_;
+            unsigned sq_index = tail & *sq_mask_;
+            io_uring_sqe* sqe = &sqes_[sq_index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            bool fixed = fixed_buffers_ && static_cast<size_t>(index) < kSlotCount;
+            sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.data);
+            sqe->len = static_cast<uint32_t>(n);
+            sqe->off = offset;
+            sqe->buf_index = fixed ? static_cast<uint16_t>(index) : 0;
+            sqe->user_data = static_cast<uint64_t>(index);
+            sq_array_[sq_index] = sq_index;
+            std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+            in_flight_++;
+            unsubmitted_++;
+
+            data += n;
+            offset += n;
+            size -= n;
+        }
+        Reap(false, ready);
+        ok = !failed_;
+    }
+    RunReady(ready);
+    return ok;
+}
+
+int UringFileWriter::AcquireSlot() {
+    for (size_t i = 0; i < kSlotCount; ++i) {
+        if (!slots_[i].busy) return static_cast<int>(i);
+    }
+
+    // Every registered buffer is in flight. Borrow one rather than wait, as
+    // long as the completion queue can hold the extra write.
+    if (!buffers_ || in_flight_ >= cq_entries_) return -1;
+    BufferPool::Buffer buffer = buffers_->Acquire(kSlotSize);
+    if (!buffer) return -1;
+    size_t index = kSlotCount;
+    while (index < slots_.size() && slots_[index].busy) index++;
+    if (index == slots_.size()) slots_.emplace_back();
+    slots_[index].data = buffer.data();
+    slots_[index].borrowed = std::move(buffer);
+    return static_cast<int>(index);
+}
+
+bool UringFileWriter::HasSqRoom() const {
+    unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+    return *sq_tail_ - head < sq_entries_;
+}
+
+void UringFileWriter::Submit() {
+    if (unsubmitted_ == 0) return;
+    int submitted = UringEnter(ring_fd_, unsubmitted_, 0, 0);
+    if (submitted < 0) {
+        failed_ = true;
+        return;
+    }
+    unsubmitted_ -= std::min(unsubmitted_, static_cast<unsigned>(submitted));
+}
+
+void UringFileWriter::Reap(bool wait, std::vector<Barrier>& ready) {
+    if (wait && in_flight_ > 0) {
+        int submitted = UringEnter(ring_fd_, unsubmitted_, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            failed_ = true;
+        } else {
+            unsubmitted_ -= std::min(unsubmitted_, static_cast<unsigned>(submitted));
+        }
+    }
+
+    unsigned head = *cq_head_;
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        size_t index = static_cast<size_t>(cqe.user_data);
+        Slot& slot = slots_[index];
+        if (cqe.res < 0) {
+            failed_ = true;
+        } else if (static_cast<size_t>(cqe.res) < slot.size) {
+            size_t done = static_cast<size_t>(cqe.res);
+            if (!FileWriter::WriteAt(slot.offset + done, slot.data + done, slot.size - done)) failed_ = true;
+        }
+        slot.busy = false;
+        if (index < kSlotCount) {
+            registered_busy_--;
+        } else {
+            slot.borrowed.Release();
+            slot.data = nullptr;
+        }
+        in_flight_--;
+        head++;
+    }
+    std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (const auto& slot : slots_) {
+        if (slot.busy) oldest = std::min(oldest, slot.seq);
+    }
+    while (!barriers_.empty() && barriers_.front().seq <= oldest) {
+        ready.push_back(std::move(barriers_.front()));
+        barriers_.pop_front();
+    }
+}
+
+void UringFileWriter::RunReady(std::vector<Barrier>& ready) {
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ok = !failed_;
+    }
+    for (auto& barrier : ready) {
+        barrier.done(ok);
+    }
+    ready.clear();
+}
+
+void UringFileWriter::AfterPendingWrites(std::function<void(bool)> done) {
+    if (ring_fd_ < 0) {
+        done(true);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (in_flight_ == 0 && barriers_.empty()) {
+        bool ok = !failed_;
+        lock.unlock();
+        done(ok);
+        return;
+    }
+    barriers_.push_back({next_seq_, std::move(done)});
+}
+
+void UringFileWriter::Poll() {
+    if (ring_fd_ < 0) return;
+    std::vector<Barrier> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Submit();
+        Reap(false, ready);
+    }
+    RunReady(ready);
+}
+
+void UringFileWriter::Flush() {
+    if (ring_fd_ < 0) return;
+    std::vector<Barrier> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Submit();
+        Reap(false, ready);
+        while (in_flight_ > 0) {
+            Reap(true, ready);
+        }
+    }
+    RunReady(ready);
+}
+
+bool UringFileWriter::IsBacklogged() {
+    if (ring_fd_ < 0) return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return registered_busy_ == kSlotCount;
+}
+
+bool UringFileWriter::Sync() {
+    Flush();
+    bool synced = FileWriter::Sync();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return synced && !failed_;
+}
+
+bool UringFileWriter::SyncCompleted() {
+    // Reaping belongs to the thread that submits; the descriptor alone
+    // covers every write whose completion has already been seen.
+    bool synced = FileWriter::Sync();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return synced && !failed_;
+}
+
+void UringFileWriter::Close() {
+    Flush();
+    TeardownRing();
+    FileWriter::Close();
+}
+
+}
+
+#endif
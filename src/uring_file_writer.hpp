@@ -0,0 +1,99 @@
+#pragma once
+#include "file_writer.hpp"
+#include "buffer_pool.hpp"
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#ifdef FASTGET_HAVE_IO_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace fastget {
+
+// Linux io_uring output backend. Spans are copied into registered buffers and
+// queued as WRITE_FIXED against the registered output descriptor; Poll()
+// submits everything queued since the last one with a single syscall and
+// reaps completions on the caller's thread. Once every registered buffer is
+// in flight the writer reports itself backlogged so transfers pause, and a
+// span that still arrives borrows a buffer from `buffers` instead of waiting
+// for the disk.
+class UringFileWriter : public FileWriter {
+public:
+    explicit UringFileWriter(const std::string& filename, BufferPool* buffers = nullptr);
+    ~UringFileWriter() override;
+
+    using FileWriter::WriteAt;
+
+    bool Open() override;
+    bool WriteAt(size_t offset, const char* data, size_t size) override;
+    bool Sync() override;
+    bool SyncCompleted() override;
+    void Close() override;
+
+    void AfterPendingWrites(std::function<void(bool)> done) override;
+    void Poll() override;
+    void Flush() override;
+    bool IsBacklogged() override;
+
+    bool IsActive() const { return ring_fd_ >= 0; }
+
+private:
+    struct Slot {
+        char* data = nullptr;
+        bool busy = false;
+        uint64_t seq = 0;
+        size_t offset = 0;
+        size_t size = 0;
+        BufferPool::Buffer borrowed; // backs `data` past the registered slots
+    };
+
+    struct Barrier {
+        uint64_t seq;
+        std::function<void(bool)> done;
+    };
+
+    bool SetupRing();
+    void TeardownRing();
+    int AcquireSlot();
+    bool HasSqRoom() const; // the submission queue can take another entry
+    void Submit();
+    void Reap(bool wait, std::vector<Barrier>& ready);
+    void RunReady(std::vector<Barrier>& ready);
+
+    int ring_fd_ = -1;
+    unsigned sq_entries_ = 0;
+    unsigned cq_entries_ = 0;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    bool fixed_buffers_ = false;
+
+    BufferPool* buffers_;
+    std::vector<Slot> slots_;
+    char* slot_memory_ = nullptr;
+    size_t registered_busy_ = 0;
+    size_t in_flight_ = 0;
+    unsigned unsubmitted_ = 0;
+    uint64_t next_seq_ = 0;
+    bool failed_ = false;
+    std::deque<Barrier> barriers_;
+    std::mutex mutex_;
+};
+
+}
+
+#endif
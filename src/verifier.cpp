@@ -5,6 +5,7 @@
 #include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <cctype>
 
 namespace fastget {
 
@@ -13,17 +14,7 @@ std::string Verifier::ComputeHash(const std::string& filename, Verifier::HashTyp
     if (!file.is_open()) return "";
 
     EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-    const EVP_MD* md = nullptr;
-    
-    switch (type) {
-        case Verifier::HashType::MD5: md = EVP_md5(); break;
-        case Verifier::HashType::SHA1: md = EVP_sha1(); break;
-        case Verifier::HashType::SHA512: md = EVP_sha512(); break;
-        case Verifier::HashType::SHA256: 
-        default: md = EVP_sha256(); break;
-    }
-
-    EVP_DigestInit_ex(ctx, md, nullptr);
+    EVP_DigestInit_ex(ctx, GetAlgorithm(type), nullptr);
 
     char buffer[32768];
     while (file.read(buffer, sizeof(buffer))) {
@@ -36,11 +27,7 @@ std::string Verifier::ComputeHash(const std::string& filename, Verifier::HashTyp
     EVP_DigestFinal_ex(ctx, hash, &hash_len);
     EVP_MD_CTX_free(ctx);
 
-    std::stringstream ss;
-    for (unsigned int i = 0; i < hash_len; ++i) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-    }
-    return ss.str();
+    return ToHex(hash, hash_len);
 }
 
 std::string Verifier::ComputeSHA256(const std::string& filename) {
@@ -64,4 +51,52 @@ bool Verifier::Verify(const std::string& filename, const std::string& expected_h
     return actual_hash == expected_hash;
 }
 
+const EVP_MD* Verifier::GetAlgorithm(Verifier::HashType type) {
+    switch (type) {
+        case Verifier::HashType::MD5: return EVP_md5();
+        case Verifier::HashType::SHA1: return EVP_sha1();
+        case Verifier::HashType::SHA512: return EVP_sha512();
+        case Verifier::HashType::SHA256:
+        default: return EVP_sha256();
+    }
+}
+
+std::string Verifier::ToHex(const unsigned char* data, size_t size) {
+    std::stringstream ss;
+    for (size_t i = 0; i < size; ++i) {
+        ss << std::hex << std::setw(2) << std::setfill('0') << (int)data[i];
+    }
+    return ss.str();
+}
+
+bool Verifier::FromHex(const std::string& hex, unsigned char* out, size_t size) {
+    if (hex.size() != size * 2) return false;
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < size; ++i) {
+        int high = nibble(hex[i * 2]);
+        int low = nibble(hex[i * 2 + 1]);
+        if (high < 0 || low < 0) return false;
+        out[i] = static_cast<unsigned char>((high << 4) | low);
+    }
+    return true;
+}
+
+bool Verifier::ParseHashType(const std::string& name, Verifier::HashType* type) {
+    std::string key;
+    for (char c : name) {
+        if (c != '-' && c != '_') key += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    if (key == "sha256") *type = HashType::SHA256;
+    else if (key == "sha512") *type = HashType::SHA512;
+    else if (key == "sha1") *type = HashType::SHA1;
+    else if (key == "md5") *type = HashType::MD5;
+    else return false;
+    return true;
+}
+
 }
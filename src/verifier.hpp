@@ -2,6 +2,8 @@
 #include <string>
 #include <vector>
 
+struct evp_md_st;
+
 namespace fastget {
 
 class Verifier {
@@ -15,6 +17,12 @@ public:
     static std::string ComputeSHA512(const std::string& filename);
 
     static bool Verify(const std::string& filename, const std::string& expected_hash, HashType type = HashType::SHA256);
+
+    static const evp_md_st* GetAlgorithm(HashType type);
+    static std::string ToHex(const unsigned char* data, size_t size);
+    static bool FromHex(const std::string& hex, unsigned char* out, size_t size);
+    // Accepts names like "sha-256", "SHA256" or "md5".
+    static bool ParseHashType(const std::string& name, HashType* type);
 };
 
 }
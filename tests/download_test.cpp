@@ -0,0 +1,84 @@
+// End-to-end downloads against an in-process server.
+#include "buffer_pool.hpp"
+#include "downloader.hpp"
+#include "test_server.hpp"
+#include <curl/curl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace fastget;
+using namespace fastget::test;
+
+static std::string g_dir;
+
+static DownloadOptions QuietOptions(BufferPool* buffers) {
+    DownloadOptions options;
+    options.buffers = buffers;
+    options.resume = false;
+    options.quiet = true;
+    options.retry_delay_ms = 10;
+    return options;
+}
+
+// A --max-memory below a single staging buffer must not park every transfer
+// waiting for memory that nothing will ever release.
+static void TestBudgetBelowOneBuffer(const TestServer& server, bool buffered, bool mmap_output) {
+    BufferPool buffers;
+    buffers.SetLimit(100 * 1024);
+    DownloadOptions options = QuietOptions(&buffers);
+    options.num_threads = 4;
+    options.buffered = buffered;
+    options.mmap_output = mmap_output;
+
+    std::string path = g_dir + "/tiny_budget.bin";
+    Downloader dl(server.Url(), {}, path, options);
+    bool success = dl.Start();
+    if (!success) std::fprintf(stderr, "download failed: %s\n", dl.GetError().c_str());
+    CHECK(success);
+    CHECK(ReadFile(path) == server.Body());
+    CHECK(buffers.GetInUse() == 0);
+    std::remove(path.c_str());
+}
+
+// A 206 for another range than the one requested must not be written at
+// the requested offset; the range is fetched again instead.
+static void TestMisplacedRange(TestServer& server) {
+    BufferPool buffers;
+    DownloadOptions options = QuietOptions(&buffers);
+    options.num_threads = 4;
+    options.retries = 4;
+
+    server.MisplaceRanges(2, 4096);
+    std::string path = g_dir + "/misplaced.bin";
+    Downloader dl(server.Url(), {}, path, options);
+    bool success = dl.Start();
+    server.MisplaceRanges(0, 0);
+    if (!success) std::fprintf(stderr, "download failed: %s\n", dl.GetError().c_str());
+    CHECK(success);
+    CHECK(ReadFile(path) == server.Body());
+    std::remove(path.c_str());
+}
+
+int main() {
+    StartWatchdog(45);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    char dir[] = "/tmp/fastget_test_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    g_dir = dir;
+
+    {
+        TestServer server(MakeBody(3 * 1024 * 1024 + 12345));
+        TestBudgetBelowOneBuffer(server, false, false);
+        TestBudgetBelowOneBuffer(server, true, false);
+        TestBudgetBelowOneBuffer(server, false, true);
+        TestMisplacedRange(server);
+    }
+
+    rmdir(dir);
+    curl_global_cleanup();
+    std::printf("download_test passed\n");
+    return 0;
+}
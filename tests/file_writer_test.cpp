@@ -0,0 +1,71 @@
+// MappedFileWriter against files it cannot grow.
+#include "file_writer.hpp"
+#include "test_server.hpp"
+#include <sys/resource.h>
+#include <csignal>
+#include <string>
+#include <unistd.h>
+
+using namespace fastget;
+using namespace fastget::test;
+
+// With the file capped below the requested size, PreAllocate cannot grow
+// it; writes must then fall back to pwrite instead of faulting on pages
+// past the end of the file.
+static void TestPreAllocateFailure(const std::string& path) {
+    rlimit limit{};
+    CHECK(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    rlimit capped = limit;
+    capped.rlim_cur = 64 * 1024;
+    CHECK(setrlimit(RLIMIT_FSIZE, &capped) == 0);
+
+    {
+        MappedFileWriter writer(path);
+        CHECK(writer.Open());
+        writer.PreAllocate(1024 * 1024);
+        std::string data = MakeBody(4096);
+        CHECK(writer.WriteAt(8192, data.data(), data.size()));
+        // Past the cap the write fails instead of crashing.
+        CHECK(!writer.WriteAt(512 * 1024, data.data(), data.size()));
+        CHECK(writer.Sync());
+        writer.Close();
+        CHECK(ReadFile(path).substr(8192) == data);
+    }
+
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    unlink(path.c_str());
+}
+
+static void TestMappedWrites(const std::string& path) {
+    std::string data = MakeBody(256 * 1024);
+    {
+        MappedFileWriter writer(path);
+        CHECK(writer.Open());
+        writer.PreAllocate(data.size());
+        // Out of order, with a sync in between, like a checkpoint mid-download.
+        CHECK(writer.WriteAt(128 * 1024, data.data() + 128 * 1024, 128 * 1024));
+        CHECK(writer.Sync());
+        CHECK(writer.WriteAt(0, data.data(), 128 * 1024));
+        CHECK(writer.Sync());
+        CHECK(!writer.WriteAt(data.size() - 1, data.data(), 2));
+    }
+    CHECK(ReadFile(path) == data);
+    unlink(path.c_str());
+}
+
+int main() {
+    StartWatchdog(30);
+    // Exceeding RLIMIT_FSIZE raises SIGXFSZ; let the syscall fail with EFBIG.
+    std::signal(SIGXFSZ, SIG_IGN);
+
+    char dir[] = "/tmp/fastget_test_XXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/mapped.bin";
+
+    TestMappedWrites(path);
+    TestPreAllocateFailure(path);
+
+    rmdir(dir);
+    std::printf("file_writer_test passed\n");
+    return 0;
+}
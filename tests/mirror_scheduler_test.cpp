@@ -0,0 +1,71 @@
+// MirrorScheduler's choice of mirror for retries and hedges.
+#include "mirror_scheduler.hpp"
+#include "test_server.hpp"
+#include <cstdio>
+
+using namespace fastget;
+using Clock = MirrorScheduler::Clock;
+
+static constexpr size_t kBytes = 1024 * 1024;
+
+static void Trip(MirrorScheduler& mirrors, size_t index, Clock::time_point now) {
+    for (int i = 0; i < 3; ++i) mirrors.OnResult(index, false, 0, 0.0, 0.1, now);
+    CHECK(mirrors.IsBroken(index));
+}
+
+static void TestExcludeAvoided() {
+    auto now = Clock::now();
+    MirrorScheduler mirrors(2, 0);
+    CHECK(mirrors.Pick(kBytes, now, 0) == 1);
+    CHECK(mirrors.Pick(kBytes, now, 1) == 0);
+}
+
+static void TestSingleMirror() {
+    auto now = Clock::now();
+    MirrorScheduler mirrors(1, 0);
+    CHECK(mirrors.Pick(kBytes, now, 0) == 0);
+}
+
+// With every other mirror circuit-broken, the excluded one is the only
+// healthy choice left, not a tripped mirror still cooling down.
+static void TestAllOthersTripped() {
+    auto now = Clock::now();
+    MirrorScheduler mirrors(3, 0);
+    Trip(mirrors, 1, now);
+    Trip(mirrors, 2, now);
+    CHECK(mirrors.Pick(kBytes, now, 0) == 0);
+
+    // Once the cooldown has passed, a tripped mirror may take a trial.
+    int trial = mirrors.Pick(kBytes, now + std::chrono::seconds(5), 0);
+    CHECK(trial == 1 || trial == 2);
+}
+
+static void TestOthersAtLimit() {
+    auto now = Clock::now();
+    MirrorScheduler mirrors(2, 1);
+    mirrors.OnStart(1);
+    CHECK(mirrors.Pick(kBytes, now, 0) == 0);
+    mirrors.OnStart(0);
+    CHECK(mirrors.Pick(kBytes, now, 0) == -1);
+}
+
+// Nothing healthy at all: every mirror is fair game, but the excluded one
+// still comes last.
+static void TestAllTripped() {
+    auto now = Clock::now();
+    MirrorScheduler mirrors(2, 0);
+    Trip(mirrors, 0, now);
+    Trip(mirrors, 1, now);
+    CHECK(mirrors.Pick(kBytes, now, 0) == 1);
+    CHECK(mirrors.Pick(kBytes, now, 1) == 0);
+}
+
+int main() {
+    TestExcludeAvoided();
+    TestSingleMirror();
+    TestAllOthersTripped();
+    TestOthersAtLimit();
+    TestAllTripped();
+    std::printf("mirror_scheduler_test passed\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "test_server.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <strings.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fastget::test {
+
+TestServer::TestServer(std::string body) : body_(std::move(body)) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) throw std::runtime_error("socket failed");
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd_, 64) != 0 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        close(listen_fd_);
+        throw std::runtime_error("cannot listen on 127.0.0.1");
+    }
+    port_ = ntohs(addr.sin_port);
+    acceptor_ = std::thread(&TestServer::AcceptLoop, this);
+}
+
+TestServer::~TestServer() {
+    stopping_ = true;
+    shutdown(listen_fd_, SHUT_RDWR);
+    acceptor_.join();
+    close(listen_fd_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int fd : clients_) shutdown(fd, SHUT_RDWR);
+    }
+    for (auto& worker : workers_) worker.join();
+}
+
+std::string TestServer::Url(const std::string& path) const {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+}
+
+void TestServer::AcceptLoop() {
+    while (!stopping_) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (stopping_) break;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.push_back(fd);
+        workers_.emplace_back(&TestServer::Serve, this, fd);
+    }
+}
+
+static bool SendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void TestServer::Serve(int fd) {
+    std::string pending;
+    char chunk[4096];
+    while (!stopping_) {
+        size_t end = pending.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) break;
+            pending.append(chunk, static_cast<size_t>(n));
+            continue;
+        }
+        std::string request = pending.substr(0, end);
+        pending.erase(0, end + 4);
+
+        bool head = request.compare(0, 5, "HEAD ") == 0;
+        size_t size = body_.size();
+        size_t first = 0;
+        size_t last = size - 1;
+        bool ranged = false;
+
+        std::istringstream lines(request);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (strncasecmp(line.c_str(), "Range: bytes=", 13) != 0) continue;
+            unsigned long long a = 0, b = 0;
+            int fields = std::sscanf(line.c_str() + 13, "%llu-%llu", &a, &b);
+            if (fields >= 1 && a < size) {
+                first = a;
+                if (fields == 2 && b < last) last = b;
+                ranged = true;
+            }
+        }
+
+        if (ranged && !head && misplace_count_.fetch_sub(1) > 0 && first + misplace_shift_ <= last) {
+            first += misplace_shift_;
+        }
+
+        std::string header;
+        if (ranged) {
+            header = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " +
+                     std::to_string(first) + "-" + std::to_string(last) + "/" +
+                     std::to_string(size) + "\r\n";
+        } else {
+            header = "HTTP/1.1 200 OK\r\n";
+        }
+        size_t length = last - first + 1;
+        header += "Accept-Ranges: bytes\r\nContent-Length: " + std::to_string(length) + "\r\n\r\n";
+        if (!SendAll(fd, header.data(), header.size())) break;
+        if (!head && !SendAll(fd, body_.data() + first, length)) break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            if (*it == fd) {
+                clients_.erase(it);
+                break;
+            }
+        }
+    }
+    close(fd);
+}
+
+std::string MakeBody(size_t size) {
+    std::string body(size, '\0');
+    uint32_t state = 2463534242u;
+    for (auto& c : body) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        c = static_cast<char>(state);
+    }
+    return body;
+}
+
+void StartWatchdog(int seconds) {
+    std::thread([seconds] {
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        std::fprintf(stderr, "timed out after %d s\n", seconds);
+        std::_Exit(1);
+    }).detach();
+}
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fails the running test with the source line; tests are plain programs run
+// by ctest, so the exit code is all that is reported.
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,      \
+                         __LINE__, #cond);                                   \
+            std::exit(1);                                                    \
+        }                                                                    \
+    } while (0)
+
+namespace fastget::test {
+
+// Minimal HTTP/1.1 server on 127.0.0.1 that serves one in-memory body at
+// every path, answering HEAD and GET with single byte ranges and keep-alive.
+class TestServer {
+public:
+    explicit TestServer(std::string body);
+    ~TestServer();
+
+    TestServer(const TestServer&) = delete;
+    TestServer& operator=(const TestServer&) = delete;
+
+    std::string Url(const std::string& path = "/file.bin") const;
+    const std::string& Body() const { return body_; }
+    // The next `count` ranged GETs get a 206 for a range starting `shift`
+    // bytes past the one asked for, as from a misbehaving cache.
+    void MisplaceRanges(int count, size_t shift) {
+        misplace_shift_ = shift;
+        misplace_count_ = count;
+    }
+
+private:
+    void AcceptLoop();
+    void Serve(int fd);
+
+    std::string body_;
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> misplace_count_{0};
+    std::atomic<size_t> misplace_shift_{0};
+    std::thread acceptor_;
+    std::mutex mutex_;
+    std::vector<int> clients_;
+    std::vector<std::thread> workers_;
+};
+
+// Deterministic, incompressible-ish test data.
+std::string MakeBody(size_t size);
+
+// Kills the test if it is still running after `seconds`; a stall is the
+// failure most of these tests look for.
+void StartWatchdog(int seconds);
+
+std::string ReadFile(const std::string& path);
+
+}